@@ -31,10 +31,37 @@
  * *Hobbit* <hobbit@avian.org>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* splice(2) */
+#endif
+
+#include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#define HAVE_SENDFILE
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#elif defined(__APPLE__)
+#define HAVE_SENDFILE
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HW
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC32C_HW
+#endif
 
 #include <arpa/inet.h>
 #include <arpa/telnet.h>
@@ -42,6 +69,7 @@
 #include <netinet/in_systm.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 
 #include "atomicio.h"
 #include <err.h>
@@ -50,14 +78,17 @@
 #include <limits.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <glib.h>
+#include <zlib.h>
 
 #ifndef SUN_LEN
 #define SUN_LEN(su)                                                            \
@@ -71,10 +102,69 @@
 #define CONNECTION_FAILED 1
 #define CONNECTION_TIMEOUT 2
 
+#define CONNECT_ATTEMPT_DELAY 250 /* Milliseconds, RFC 8305 */
+
 #define UDP_SCAN_TIMEOUT 3 /* Seconds */
+#define UDP_SCAN_TRIES 3   /* Probes per port with IP_RECVERR */
+#define UDP_SCAN_GAP 10    /* Milliseconds between bursts of probes */
+
+#define RELAY_BUF_SIZE (256 * 1024) /* Default -B, per direction */
+#define SENDFILE_CHUNK (1024 * 1024) /* Bytes sent per sendfile() */
+#define UDP_GSO_SEGS 64      /* Most datagrams in one UDP_SEGMENT send */
+#define UDP_GSO_BYTES 65000  /* Most bytes in one UDP_SEGMENT send */
+#define UDP_GRO_SIZE 65536   /* Receive slot for a UDP_GRO train */
+#define UDP_GRO_SLOTS 8      /* Fewest receive slots with UDP_GRO */
+#define TELNET_REPLIES 64    /* Option refusals sent per write */
+#define PACE_BURST_MS 20     /* -L bucket depth, in time at the rate */
+#define ZLIB_FLUSH_MS 10     /* Longest -Z holds back input it has read */
+#define HASH_HEADER 4        /* -H frame header: 32-bit length of the data */
+#define HASH_TRAILER 16      /* -H end: empty header, 64-bit length, CRC32C */
+#define STRIPE_MAX 64        /* Most connections in a -Y transfer */
+#define STRIPE_HELLO_WAIT 10 /* Seconds a -Y connection has for its hello */
+#define EARLY_DATA_MAX 4096  /* Most stdin bytes -E sends with a request */
+
+/*
+ * Where atelnet() is in the telnet command stream of one connection. It
+ * is kept from one read to the next, since a command can be split
+ * across them.
+ */
+struct telnet {
+  int state;          /* TELNET_DATA, TELNET_IAC, ... */
+  unsigned char verb; /* WILL, WONT, DO or DONT waiting for its option */
+};
+
+#define TELNET_DATA 0  /* Plain data */
+#define TELNET_IAC 1   /* After an IAC */
+#define TELNET_OPT 2   /* After IAC and a verb */
+#define TELNET_SB 3    /* Inside a subnegotiation */
+#define TELNET_SBIAC 4 /* After an IAC inside a subnegotiation */
+
+/*
+ * One connection of a -Y striped transfer. Each starts with a hello of
+ * five 32-bit words: STRIPE_MAGIC, a session number, the connection
+ * count, this connection's index and the largest chunk. Chunks follow,
+ * each a 64-bit sequence number and a 32-bit length ahead of the data.
+ * A chunk of length 0 ends the connection and carries the chunk count.
+ */
+struct stripe {
+  int fd;
+  int state;                  /* STRIPE_HEAD, STRIPE_BODY, ... */
+  unsigned long long seq;     /* Sequence number of the chunk in buf */
+  uint32_t hdr[3];            /* Chunk header on the wire */
+  unsigned char *buf;         /* Chunk, after the header when sending */
+  size_t off, len;            /* Bytes of the chunk done and in all */
+};
+
+#define STRIPE_HEAD 0  /* Reading a chunk header, or idle when sending */
+#define STRIPE_BODY 1  /* Reading chunk data */
+#define STRIPE_READY 2 /* Holding a chunk until it is next in order */
+#define STRIPE_END 3   /* End of the connection read or queued */
+
+#define STRIPE_MAGIC 0x6e635931 /* "ncY1" */
+#define HASH_MAGIC 0x6e634831   /* "ncH1" */
 
 /* Command Line Options */
-int Cflag = 0;  /* CRLF line-ending */
+int Cflag = 0;  /* CRLF line-ending, 2 to keep existing CRLFs */
 int dflag;      /* detached, no stdin */
 int iflag;      /* Interval Flag */
 int jflag;      /* use jumbo frames if we can */
@@ -95,36 +185,105 @@ int Dflag;      /* sodebug */
 int Sflag;      /* TCP MD5 signature option */
 int Tflag = -1; /* IP Type of Service */
 
+int Bflag = RELAY_BUF_SIZE; /* Relay buffer size */
+int mflag = 1;              /* Connections in flight at once */
+int bflag = -1;             /* listen() backlog */
+int Rflag = -1;             /* Statistics, progress every Rflag secs */
+int aflag;                  /* Relay and connect with io_uring */
+int Fflag;                  /* TCP Fast Open */
+int Iflag;                  /* Socket receive buffer size */
+int Oflag;                  /* Socket send buffer size */
+double Lflag[2];            /* Send and receive rates per second, or 0 */
+int Lwrites[2];             /* The -L rate counts writes, not bytes */
+int Yflag;                  /* Stripe the transfer over this many streams */
+int Zflag;                  /* zlib level for what is sent, 0 for none */
+int Hflag;                  /* Checksum each direction and compare */
+int Eflag;                  /* Pipeline the proxy handshake */
+
+/* Socket options given with -o */
+char *so_congestion;   /* TCP_CONGESTION algorithm */
+int so_lowat = -1;     /* TCP_NOTSENT_LOWAT */
+int so_cork;           /* TCP_CORK while stdin keeps the socket busy */
+int so_keepalive;      /* SO_KEEPALIVE */
+int so_keepidle;       /* TCP_KEEPIDLE, 0 for the system default */
+int so_keepintvl;      /* TCP_KEEPINTVL, 0 for the system default */
+int so_keepcnt;        /* TCP_KEEPCNT, 0 for the system default */
+
 int timeout = -1;
 int family = AF_UNSPEC;
+int plen; /* Largest datagram read or written */
 char *portlist[PORT_MAX + 1];
 
-void atelnet(int, unsigned char *, unsigned int);
+size_t atelnet(int, struct telnet *, unsigned char *, size_t);
 void build_ports(char *);
 void help(void);
 int local_listen(char *, char *, struct addrinfo);
+void serve_clients(int, char *);
+int stripe_send(const char *, const char *, struct addrinfo);
+int stripe_recv(int, char *);
 void readwrite(int);
+void relay_preload(int, const void *, size_t);
 int remote_connect(const char *, const char *, struct addrinfo);
+void resolve_start(const char *, const struct addrinfo *);
+int resolve(const char *, const char *, const struct addrinfo *,
+            struct addrinfo **);
+void resolve_free(struct addrinfo *);
+int scan_ports(const char *, struct addrinfo, const char *, const char *,
+               struct addrinfo, int);
 int socks_connect(const char *, const char *, struct addrinfo, const char *,
-                  const char *, struct addrinfo, int, const char *);
+                  const char *, struct addrinfo, int, const char *, int,
+                  const void *, size_t);
+void socks_password(const char *, const char *);
+const char *socks_port(int);
+struct socks_hs *socks_start(int, const char *, const char *, int,
+                             const char *);
+int socks_step(struct socks_hs *, short *, const char **);
+void socks_free(struct socks_hs *);
+size_t stdin_early(unsigned char *, size_t);
 int udptest(int);
+#ifdef IP_RECVERR
+int udp_scan_ports(const char *, struct addrinfo);
+#endif
 int unix_connect(char *);
 int unix_listen(char *);
 void set_common_sockopts(int);
 int parse_iptos(char *);
+void parse_rate(char *, double *, int *);
+void parse_sockopts(char *);
 void report_sock(const char *, const struct sockaddr *, socklen_t, char *);
 void usage(int);
 char *proto_name(int);
 
-static int connect_with_timeout(int fd, const struct sockaddr *sa,
-                                socklen_t salen, int ctimeout);
+static int interleave_addrs(struct addrinfo *, struct addrinfo ***);
+static long long monotime_ms(void);
+static long long monotime_us(void);
+static long long monotime_ns(void);
+static int poll_ns(struct pollfd *, nfds_t, long long);
+static int set_nonblock(int);
+static void source_hints(struct addrinfo *);
+static void source_bind(int, int);
+static void report_connect(const char *, const char *);
+static void fastopen_kick(int);
+static void report_fastopen(int);
+static void set_bufsize(int, int, int);
+#ifdef SPLICE_F_MOVE
+static int splice_pipe(int[2], size_t *);
+#endif
+#ifdef HAVE_SENDFILE
+static ssize_t sendfile_relay(int, int, size_t);
+#endif
+#ifdef HAVE_IO_URING
+static int uring_readwrite(int);
+static int uring_race(struct addrinfo **, int, const char *, const char *);
+#endif
+static void restore_stdio(void);
+static void relay_report(void);
 static void quit();
 
 int main(int argc, char *argv[]) {
   int ch, s, ret, socksv;
   char *host, *uport, *endp;
   struct addrinfo hints;
-  struct servent *sv;
   socklen_t len;
   struct sockaddr_storage cliaddr;
   char *proxy = NULL;
@@ -137,10 +296,10 @@ int main(int argc, char *argv[]) {
   host = NULL;
   uport = NULL;
   endp = NULL;
-  sv = NULL;
 
-  while ((ch = getopt(argc, argv, "46Ddhi:jklnP:p:q:rSs:tT:UuZvw:X:x:zC")) !=
-         -1) {
+  while ((ch = getopt(argc, argv,
+                      "46aB:b:DdEFHhI:i:jkL:lm:nO:o:P:p:q:R:rSs:"
+                      "tT:UuvZ:w:X:x:Y:zC")) != -1) {
     switch (ch) {
     case '4':
       family = AF_INET;
@@ -148,9 +307,22 @@ int main(int argc, char *argv[]) {
     case '6':
       family = AF_INET6;
       break;
+    case 'a':
+      aflag = 1;
+      break;
     case 'U':
       family = AF_UNIX;
       break;
+    case 'B':
+      Bflag = (int)strtoul(optarg, &endp, 10);
+      if (Bflag < 8192 || *endp != '\0')
+        errx(1, "buffer size must be at least 8192");
+      break;
+    case 'b':
+      bflag = (int)strtoul(optarg, &endp, 10);
+      if (bflag < 1 || *endp != '\0')
+        errx(1, "backlog not valid");
+      break;
     case 'X':
       if (strcasecmp(optarg, "connect") == 0)
         socksv = -1; /* HTTP proxy CONNECT */
@@ -164,9 +336,20 @@ int main(int argc, char *argv[]) {
     case 'd':
       dflag = 1;
       break;
+    case 'F':
+      Fflag = 1;
+      break;
+    case 'H':
+      Hflag = 1;
+      break;
     case 'h':
       help();
       break;
+    case 'I':
+      Iflag = (int)strtoul(optarg, &endp, 10);
+      if (Iflag < 1 || *endp != '\0')
+        errx(1, "receive buffer size not valid");
+      break;
     case 'i':
       iflag = (int)strtoul(optarg, &endp, 10);
       if (iflag < 0 || *endp != '\0')
@@ -178,12 +361,34 @@ int main(int argc, char *argv[]) {
     case 'k':
       kflag = 1;
       break;
+    case 'L':
+      /* The receive rate follows a comma; either may be left empty. */
+      if ((endp = strchr(optarg, ',')) != NULL)
+        *endp++ = '\0';
+      if (*optarg != '\0')
+        parse_rate(optarg, &Lflag[0], &Lwrites[0]);
+      if (endp != NULL && *endp != '\0')
+        parse_rate(endp, &Lflag[1], &Lwrites[1]);
+      break;
     case 'l':
       lflag = 1;
       break;
+    case 'm':
+      mflag = (int)strtoul(optarg, &endp, 10);
+      if (mflag < 1 || mflag > PORT_MAX || *endp != '\0')
+        errx(1, "connection count not valid");
+      break;
     case 'n':
       nflag = 1;
       break;
+    case 'O':
+      Oflag = (int)strtoul(optarg, &endp, 10);
+      if (Oflag < 1 || *endp != '\0')
+        errx(1, "send buffer size not valid");
+      break;
+    case 'o':
+      parse_sockopts(optarg);
+      break;
     case 'P':
       Pflag = optarg;
       break;
@@ -193,6 +398,11 @@ int main(int argc, char *argv[]) {
     case 'q':
       qflag = (int)strtoul(optarg, &endp, 10);
       break;
+    case 'R':
+      Rflag = (int)strtoul(optarg, &endp, 10);
+      if (Rflag < 0 || Rflag > INT_MAX / 1000 || *endp != '\0')
+        errx(1, "statistics interval not valid");
+      break;
     case 'r':
       rflag = 1;
       break;
@@ -221,12 +431,25 @@ int main(int argc, char *argv[]) {
       if ((proxy = strdup(optarg)) == NULL)
         err(1, NULL);
       break;
+    case 'Y':
+      Yflag = (int)strtoul(optarg, &endp, 10);
+      if (Yflag < 1 || Yflag > STRIPE_MAX || *endp != '\0')
+        errx(1, "stripe count not valid");
+      break;
+    case 'Z':
+      Zflag = (int)strtoul(optarg, &endp, 10);
+      if (Zflag < 1 || Zflag > 9 || *endp != '\0')
+        errx(1, "compression level must be 1 to 9");
+      break;
     case 'z':
       zflag = 1;
       break;
     case 'D':
       Dflag = 1;
       break;
+    case 'E':
+      Eflag = 1;
+      break;
     case 'S':
       Sflag = 1;
       break;
@@ -234,7 +457,7 @@ int main(int argc, char *argv[]) {
       Tflag = parse_iptos(optarg);
       break;
     case 'C':
-      Cflag = 1;
+      Cflag++;
       break;
     default:
       usage(1);
@@ -243,6 +466,8 @@ int main(int argc, char *argv[]) {
   argc -= optind;
   argv += optind;
 
+  plen = jflag ? 8192 : 1024;
+
   /* Cruft to make sure options are clean, and used properly. */
   if (argc == 1 && family == AF_UNIX) {
     host = argv[0];
@@ -262,6 +487,19 @@ int main(int argc, char *argv[]) {
     errx(1, "cannot use -z and -l");
   if (!lflag && kflag)
     errx(1, "must use -l with -k");
+  if (uflag && Fflag)
+    errx(1, "cannot use -F and -u");
+  if (Yflag && (uflag || xflag || zflag))
+    errx(1, "cannot use -Y with -u, -x or -z");
+  if (Yflag && (Cflag || Hflag || iflag || tflag || Zflag || Lflag[0] > 0 ||
+                Lflag[1] > 0))
+    errx(1, "cannot use -Y with -C, -H, -i, -L, -t or -Z");
+  if (Zflag && (Cflag || tflag || uflag))
+    errx(1, "cannot use -Z with -C, -t or -u");
+  if (Hflag && (tflag || uflag))
+    errx(1, "cannot use -H with -t or -u");
+  if (Eflag && !xflag)
+    errx(1, "must use -x with -E");
 
   /* Initialize addrinfo structure. */
   if (family != AF_UNIX) {
@@ -283,15 +521,23 @@ int main(int argc, char *argv[]) {
     if (family == AF_UNIX)
       errx(1, "no proxy support for unix sockets");
 
-    /* XXX IPv6 transport to proxy would probably work */
-    if (family == AF_INET6)
-      errx(1, "no proxy support for IPv6");
-
     if (sflag)
       errx(1, "no proxy support for local source address");
 
-    proxyhost = strsep(&proxy, ":");
-    proxyport = proxy;
+    /* An IPv6 proxy address takes brackets to be followed by a port. */
+    if (*proxy == '[' && (endp = strchr(proxy, ']')) != NULL) {
+      *endp++ = '\0';
+      if (*endp != '\0' && *endp != ':')
+        errx(1, "invalid proxy address \"%s]%s\"", proxy, endp);
+      proxyhost = proxy + 1;
+      proxyport = *endp == ':' ? endp + 1 : NULL;
+    } else if (strchr(proxy, ':') != strrchr(proxy, ':')) {
+      proxyhost = proxy;
+      proxyport = NULL;
+    } else {
+      proxyhost = strsep(&proxy, ":");
+      proxyport = proxy;
+    }
 
     memset(&proxyhints, 0, sizeof(struct addrinfo));
     proxyhints.ai_family = family;
@@ -301,6 +547,17 @@ int main(int argc, char *argv[]) {
       proxyhints.ai_flags |= AI_NUMERICHOST;
   }
 
+  /* Look up the hosts needed to connect in parallel. */
+  if (!lflag && family != AF_UNIX) {
+    struct addrinfo ahints;
+
+    resolve_start(xflag ? proxyhost : host, xflag ? &proxyhints : &hints);
+    if (sflag) {
+      source_hints(&ahints);
+      resolve_start(sflag, &ahints);
+    }
+  }
+
   if (lflag) {
     int connfd;
     ret = 0;
@@ -308,13 +565,36 @@ int main(int argc, char *argv[]) {
     if (family == AF_UNIX)
       s = unix_listen(host);
 
+    /* Take striped transfers one after another. */
+    if (Yflag) {
+      if (family != AF_UNIX)
+        s = local_listen(host, uport, hints);
+      if (s < 0)
+        err(1, NULL);
+      do
+        ret = stripe_recv(s, family == AF_UNIX ? host : NULL);
+      while (kflag);
+      exit(ret);
+    }
+
+    /* Serve many clients at once from a single listening socket. */
+    if (kflag && !uflag && mflag > 1) {
+      if (Cflag || Hflag || iflag || Lflag[0] > 0 || Lflag[1] > 0 ||
+          Rflag != -1 || Zflag)
+        errx(1, "cannot use -C, -H, -i, -L, -R or -Z with -m");
+      if (family != AF_UNIX)
+        s = local_listen(host, uport, hints);
+      if (s < 0)
+        err(1, NULL);
+      serve_clients(s, family == AF_UNIX ? host : NULL);
+      exit(1);
+    }
+
     /* Allow only one connection at a time, but stay alive. */
     for (;;) {
-      if (family != AF_UNIX) {
-        if (s != -1)
-          close(s);
+      /* A UDP listener is used up by connecting it to the client. */
+      if (family != AF_UNIX && s == -1)
         s = local_listen(host, uport, hints);
-      }
       if (s < 0)
         err(1, NULL);
       /*
@@ -323,11 +603,10 @@ int main(int argc, char *argv[]) {
        * functions to talk to the caller.
        */
       if (uflag) {
-        int rv, plen;
+        int rv;
         char buf[8192];
 
         len = sizeof(cliaddr);
-        plen = jflag ? 8192 : 1024;
         rv =
             recvfrom(s, buf, plen, MSG_PEEK, (struct sockaddr *)&cliaddr, &len);
         if (rv < 0)
@@ -351,8 +630,8 @@ int main(int argc, char *argv[]) {
 
       readwrite(connfd);
       close(connfd);
-      if (family != AF_UNIX)
-        close(s);
+      if (connfd == s)
+        s = -1;
 
       if (!kflag)
         break;
@@ -360,6 +639,9 @@ int main(int argc, char *argv[]) {
   } else if (family == AF_UNIX) {
     ret = 0;
 
+    if (Yflag)
+      exit(stripe_send(host, NULL, hints));
+
     if ((s = unix_connect(host)) > 0 && !zflag) {
       readwrite(s);
       close(s);
@@ -370,10 +652,35 @@ int main(int argc, char *argv[]) {
 
   } else {
     int i = 0;
+    unsigned char early[EARLY_DATA_MAX];
+    size_t earlylen = 0;
 
     /* Construct the portlist[] array. */
     build_ports(uport);
 
+    if (Yflag) {
+      if (portlist[1] != NULL)
+        errx(1, "cannot use -Y with a port range");
+      exit(stripe_send(host, portlist[0], hints));
+    }
+
+    /* Scan many ports at once; -p pins every connect to one source port. */
+    if (zflag && !uflag && !pflag && mflag > 1)
+      exit(scan_ports(host, hints, proxyhost, proxyport, proxyhints, socksv));
+#ifdef IP_RECVERR
+    /* Probe UDP ports in bulk and let ICMP errors rule out closed ones. */
+    if (zflag && uflag)
+      exit(udp_scan_ports(host, hints));
+#endif
+
+    /*
+     * With -E, stdin that is already waiting goes out with the proxy
+     * request, unless it would have been converted or accounted for.
+     */
+    if (Eflag && portlist[1] == NULL && !dflag && !zflag && !Cflag &&
+        !Hflag && !iflag && !Zflag && Lflag[0] == 0)
+      earlylen = stdin_early(early, sizeof(early));
+
     /* Cycle through portlist, connecting to each port. */
     for (i = 0; portlist[i] != NULL; i++) {
       if (s)
@@ -381,7 +688,7 @@ int main(int argc, char *argv[]) {
 
       if (xflag)
         s = socks_connect(host, portlist[i], hints, proxyhost, proxyport,
-                          proxyhints, socksv, Pflag);
+                          proxyhints, socksv, Pflag, Eflag, early, earlylen);
       else
         s = remote_connect(host, portlist[i], hints);
 
@@ -400,19 +707,8 @@ int main(int argc, char *argv[]) {
           }
         }
 
-        /* Don't look up port if -n. */
-        if (nflag)
-          sv = NULL;
-        else {
-          sv = getservbyport(ntohs(atoi(portlist[i])), uflag ? "udp" : "tcp");
-        }
-
         if (print_info == 1)
-          fprintf(stderr,
-                  "Connection to %s %s port [%s/%s] "
-                  "succeeded!\n",
-                  host, portlist[i], uflag ? "udp" : "tcp",
-                  sv ? sv->s_name : "*");
+          report_connect(host, portlist[i]);
       }
       if (!zflag)
         readwrite(s);
@@ -425,6 +721,569 @@ int main(int argc, char *argv[]) {
   exit(ret);
 }
 
+/* A client of serve_clients(). */
+struct client {
+  unsigned char *buf; /* Stdin data not yet sent to it, Bflag bytes */
+  size_t off, len;    /* Start and length of that data in buf */
+  int shut;           /* Its sending side has been shut down */
+  struct telnet tn;
+};
+
+/*
+ * client_close()
+ * Disconnect the client of serve_clients() on p.
+ */
+static void client_close(struct pollfd *p, struct client *cl) {
+  close(p->fd);
+  p->fd = -1;
+  free(cl->buf);
+  memset(cl, 0, sizeof(*cl));
+}
+
+/*
+ * serve_clients()
+ * Accept up to mflag clients at once on the listening socket s and copy
+ * whatever each of them sends to stdout. Data read from stdin is queued
+ * for every connected client, each of which has up to Bflag bytes of it
+ * waiting; a client that falls further behind is dropped so that it
+ * cannot hold up the others. Runs until stdout fails or nc is killed.
+ */
+void serve_clients(int s, char *path) {
+  struct sockaddr_storage cliaddr;
+  struct pollfd *pfd;
+  struct client *cl;
+  unsigned char *buf;
+  socklen_t len;
+  ssize_t n;
+  int i, fd, nclients = 0, stdin_eof = dflag;
+  int wfd = fileno(stdin), lfd = fileno(stdout);
+
+  /* pfd[0] is the listener, pfd[1] stdin and the rest are clients. */
+  if ((pfd = calloc(mflag + 2, sizeof(*pfd))) == NULL ||
+      (cl = calloc(mflag + 2, sizeof(*cl))) == NULL ||
+      (buf = malloc(Bflag)) == NULL)
+    err(1, NULL);
+  for (i = 0; i < mflag + 2; i++)
+    pfd[i].fd = -1;
+  pfd[0].events = pfd[1].events = POLLIN;
+
+  for (;;) {
+    /* Past the limit, clients wait in the listen queue. */
+    pfd[0].fd = nclients < mflag ? s : -1;
+    pfd[1].fd = stdin_eof || nclients == 0 ? -1 : wfd;
+    for (i = 2; i < mflag + 2; i++)
+      pfd[i].events = cl[i].len > 0 ? POLLIN | POLLOUT : POLLIN;
+
+    if (poll(pfd, mflag + 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "Polling Error");
+    }
+
+    if (pfd[0].revents & POLLIN) {
+      len = sizeof(cliaddr);
+      if ((fd = accept(s, (struct sockaddr *)&cliaddr, &len)) != -1) {
+        if (vflag)
+          report_sock("Connection received", (struct sockaddr *)&cliaddr,
+                      len, path);
+        (void)set_nonblock(fd);
+        for (i = 2; pfd[i].fd != -1; i++)
+          ;
+        pfd[i].fd = fd;
+        if (!stdin_eof && (cl[i].buf = malloc(Bflag)) == NULL)
+          err(1, NULL);
+        nclients++;
+      }
+    }
+
+    if (pfd[1].revents & (POLLIN | POLLHUP)) {
+      if ((n = read(wfd, buf, plen)) <= 0) {
+        stdin_eof = 1;
+        /* if user asked to die after a while, arrange for it */
+        if (qflag > 0) {
+          signal(SIGALRM, quit);
+          alarm(qflag);
+        }
+      }
+      for (i = 2; n > 0 && i < mflag + 2; i++) {
+        if (pfd[i].fd == -1)
+          continue;
+        if (cl[i].off + cl[i].len + n > (size_t)Bflag) {
+          memmove(cl[i].buf, cl[i].buf + cl[i].off, cl[i].len);
+          cl[i].off = 0;
+        }
+        if (cl[i].len + n > (size_t)Bflag) {
+          if (vflag)
+            warnx("dropping a client that is %zu bytes behind", cl[i].len);
+          client_close(&pfd[i], &cl[i]);
+          nclients--;
+          continue;
+        }
+        memcpy(cl[i].buf + cl[i].off + cl[i].len, buf, n);
+        cl[i].len += n;
+      }
+    }
+
+    for (i = 2; i < mflag + 2; i++) {
+      if (pfd[i].fd == -1 || !(pfd[i].revents & POLLOUT))
+        continue;
+      if ((n = send(pfd[i].fd, cl[i].buf + cl[i].off, cl[i].len,
+                    MSG_NOSIGNAL)) < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+          continue;
+        client_close(&pfd[i], &cl[i]);
+        nclients--;
+        continue;
+      }
+      cl[i].off += n;
+      if ((cl[i].len -= n) == 0)
+        cl[i].off = 0;
+    }
+
+    /* Clients learn of EOF on stdin once they have been sent the rest. */
+    for (i = 2; stdin_eof && qflag <= 0 && i < mflag + 2; i++) {
+      if (pfd[i].fd != -1 && cl[i].len == 0 && !cl[i].shut) {
+        shutdown(pfd[i].fd, SHUT_WR);
+        cl[i].shut = 1;
+      }
+    }
+
+    for (i = 2; i < mflag + 2; i++) {
+      if (pfd[i].fd == -1 || !(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      if ((n = read(pfd[i].fd, buf, Bflag)) <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+          continue;
+        client_close(&pfd[i], &cl[i]);
+        nclients--;
+        continue;
+      }
+      if (tflag)
+        n = atelnet(pfd[i].fd, &cl[i].tn, buf, n);
+      if (atomicio(vwrite, lfd, buf, n) != (size_t)n)
+        goto done;
+    }
+  }
+
+done:
+  for (i = 2; i < mflag + 2; i++) {
+    if (pfd[i].fd != -1)
+      client_close(&pfd[i], &cl[i]);
+  }
+  free(pfd);
+  free(cl);
+  free(buf);
+}
+
+/*
+ * stripe_frame()
+ * Put the chunk of len bytes at st->buf + sizeof(st->hdr) behind its
+ * header, ready to send. A len of 0 queues the end of the connection.
+ */
+static void stripe_frame(struct stripe *st, unsigned long long seq,
+                         size_t len) {
+  st->hdr[0] = htonl((uint32_t)(seq >> 32));
+  st->hdr[1] = htonl((uint32_t)seq);
+  st->hdr[2] = htonl((uint32_t)len);
+  memcpy(st->buf, st->hdr, sizeof(st->hdr));
+  st->off = 0;
+  st->len = sizeof(st->hdr) + len;
+  st->state = len ? STRIPE_HEAD : STRIPE_END;
+}
+
+/*
+ * stripe_connect()
+ * Open connection i of a striped transfer and send its hello.
+ */
+static int stripe_connect(const char *host, const char *port,
+                          struct addrinfo hints, uint32_t session, int i) {
+  uint32_t hello[5];
+  int s;
+
+  if (family == AF_UNIX)
+    s = unix_connect((char *)host);
+  else
+    s = remote_connect(host, port, hints);
+  if (s < 0)
+    return (-1);
+  hello[0] = htonl(STRIPE_MAGIC);
+  hello[1] = htonl(session);
+  hello[2] = htonl(Yflag);
+  hello[3] = htonl(i);
+  hello[4] = htonl(Bflag);
+  if (send(s, hello, sizeof(hello), MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) {
+    close(s);
+    return (-1);
+  }
+  return (s);
+}
+
+/*
+ * stripe_report()
+ * Print the -R summary of a striped transfer.
+ */
+static void stripe_report(const char *what, unsigned long long bytes,
+                          unsigned long long chunks, long long start) {
+  double secs = (monotime_us() - start) / 1e6;
+
+  if (Rflag == -1)
+    return;
+  fprintf(stderr,
+          "%s: %llu bytes in %.2f s (%.2f MB/s), %llu chunks over %d "
+          "connections\n",
+          what, bytes, secs, secs > 0 ? bytes / secs / 1e6 : 0.0, chunks,
+          Yflag);
+}
+
+/*
+ * stripe_send()
+ * Split stdin into chunks of up to Bflag bytes and send them over Yflag
+ * connections to host. Each chunk goes to the next connection that has
+ * handed its last one to the kernel, so slow paths carry less. Returns
+ * 0 once the receiver has closed every connection, 1 on failure.
+ */
+int stripe_send(const char *host, const char *port, struct addrinfo hints) {
+  struct stripe *st;
+  struct pollfd *pfd;
+  unsigned long long seq = 0, bytes = 0;
+  long long start;
+  uint32_t session;
+  ssize_t n;
+  int i, idle, next = 0, left = Yflag, ret = 1;
+  int in = dflag ? -1 : fileno(stdin);
+
+  if ((st = calloc(Yflag, sizeof(*st))) == NULL ||
+      (pfd = calloc(Yflag + 1, sizeof(*pfd))) == NULL)
+    err(1, NULL);
+  for (i = 0; i < Yflag; i++)
+    st[i].fd = -1;
+  session = (uint32_t)(getpid() ^ monotime_ns());
+  for (i = 0; i < Yflag; i++) {
+    if ((st[i].fd = stripe_connect(host, port, hints, session, i)) < 0)
+      goto done;
+    if ((st[i].buf = malloc(sizeof(st[i].hdr) + Bflag)) == NULL)
+      err(1, NULL);
+    (void)set_nonblock(st[i].fd);
+  }
+  if (vflag && family != AF_UNIX)
+    report_connect(host, port);
+
+  start = monotime_us();
+  while (left > 0) {
+    idle = -1;
+    for (i = 0; i < Yflag; i++) {
+      struct stripe *sp = &st[(next + i) % Yflag];
+
+      if (sp->fd == -1 || sp->off < sp->len || sp->state == STRIPE_END)
+        continue;
+      if (in == -1)
+        stripe_frame(sp, seq, 0);
+      else if (idle == -1)
+        idle = (next + i) % Yflag;
+    }
+
+    /* stdin is read only when a connection can take the chunk. */
+    pfd[0].fd = in != -1 && idle != -1 ? in : -1;
+    pfd[0].events = POLLIN;
+    for (i = 0; i < Yflag; i++) {
+      pfd[i + 1].fd = st[i].fd;
+      pfd[i + 1].events = st[i].off < st[i].len ? POLLOUT : 0;
+      if (st[i].state == STRIPE_END && st[i].off == st[i].len)
+        pfd[i + 1].events = POLLIN;
+      if (pfd[i + 1].events == 0)
+        pfd[i + 1].fd = -1;
+    }
+    if ((n = poll(pfd, Yflag + 1, timeout)) < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "Polling Error");
+    }
+    if (n == 0)
+      goto done;
+
+    if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      n = read(in, st[idle].buf + sizeof(st[idle].hdr), Bflag);
+      if (n <= 0) {
+        in = -1;
+      } else {
+        stripe_frame(&st[idle], seq++, n);
+        bytes += n;
+        next = (idle + 1) % Yflag;
+      }
+    }
+
+    for (i = 0; i < Yflag; i++) {
+      if (pfd[i + 1].revents == 0)
+        continue;
+      if (pfd[i + 1].events & POLLIN) {
+        /* The receiver closes once it has written everything out. */
+        if ((n = read(st[i].fd, st[i].buf, Bflag)) < 0 &&
+            (errno == EAGAIN || errno == EINTR))
+          continue;
+        if (n != 0) {
+          warnx("connection %d of the striped transfer failed", i);
+          goto done;
+        }
+        close(st[i].fd);
+        st[i].fd = -1;
+        left--;
+        continue;
+      }
+      n = send(st[i].fd, st[i].buf + st[i].off, st[i].len - st[i].off,
+               MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+          continue;
+        warn("write");
+        goto done;
+      }
+      st[i].off += n;
+      if (st[i].off == st[i].len && st[i].state == STRIPE_END)
+        shutdown(st[i].fd, SHUT_WR);
+    }
+  }
+  stripe_report("send", bytes, seq, start);
+  ret = 0;
+
+done:
+  for (i = 0; i < Yflag; i++) {
+    if (st[i].fd != -1)
+      close(st[i].fd);
+    free(st[i].buf);
+  }
+  free(st);
+  free(pfd);
+  return (ret);
+}
+
+/*
+ * stripe_hello()
+ * Read the hello of a connection to a -Y listener, giving up after the
+ * -w timeout or STRIPE_HELLO_WAIT seconds, so that a port probe or a
+ * stray client cannot hold up the transfer. Returns 0 or -1.
+ */
+static int stripe_hello(int fd, uint32_t *hello, size_t size) {
+  struct pollfd pfd;
+  long long deadline, wait;
+  size_t got = 0;
+  ssize_t n;
+
+  deadline = monotime_ms() + (timeout > 0 ? timeout : STRIPE_HELLO_WAIT * 1000);
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (got < size) {
+    if ((wait = deadline - monotime_ms()) <= 0)
+      return (-1);
+    if ((n = poll(&pfd, 1, (int)wait)) < 0 && errno != EINTR)
+      return (-1);
+    if (n <= 0)
+      continue;
+    if ((n = read(fd, (char *)hello + got, size - got)) < 0 &&
+        (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (n <= 0)
+      return (-1);
+    got += n;
+  }
+  return (0);
+}
+
+/*
+ * stripe_accept()
+ * Accept the connections of one striped transfer on s into st[]. The
+ * first hello sets the session; connections from other sessions are
+ * turned away. Returns the largest chunk the sender uses.
+ */
+static size_t stripe_accept(int s, char *path, struct stripe *st) {
+  struct sockaddr_storage cliaddr;
+  socklen_t len;
+  uint32_t hello[5], session = 0, chunk = 0;
+  int fd, got = 0;
+
+  while (got < Yflag) {
+    len = sizeof(cliaddr);
+    if ((fd = accept(s, (struct sockaddr *)&cliaddr, &len)) == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      err(1, "accept");
+    }
+    if (vflag)
+      report_sock("Connection received", (struct sockaddr *)&cliaddr, len,
+                  path);
+    if (stripe_hello(fd, hello, sizeof(hello)) < 0 ||
+        ntohl(hello[0]) != STRIPE_MAGIC) {
+      warnx("connection is not part of a striped transfer");
+      close(fd);
+      continue;
+    }
+    if (ntohl(hello[2]) != (uint32_t)Yflag) {
+      warnx("sender stripes over %u connections, not %d", ntohl(hello[2]),
+            Yflag);
+      close(fd);
+      continue;
+    }
+    /* Each connection gets a buffer of one chunk; -B bounds it. */
+    if (ntohl(hello[4]) > (uint32_t)Bflag) {
+      warnx("sender uses chunks of %u bytes, more than -B %d", ntohl(hello[4]),
+            Bflag);
+      close(fd);
+      continue;
+    }
+    if (got == 0) {
+      session = ntohl(hello[1]);
+      chunk = ntohl(hello[4]);
+    }
+    if (ntohl(hello[1]) != session || ntohl(hello[3]) >= (uint32_t)Yflag ||
+        st[ntohl(hello[3])].fd != -1 || chunk == 0) {
+      warnx("connection is not part of this striped transfer");
+      close(fd);
+      continue;
+    }
+    st[ntohl(hello[3])].fd = fd;
+    got++;
+  }
+  return (chunk);
+}
+
+/*
+ * stripe_read()
+ * Read what has arrived on st without blocking: the rest of a header,
+ * then the chunk it announces. Returns -1 on failure, or 0 once the
+ * connection must wait for data or for its chunk to be written.
+ */
+static int stripe_read(struct stripe *st, size_t chunk, int i) {
+  unsigned char *p;
+  size_t want;
+  ssize_t n;
+
+  while (st->state == STRIPE_HEAD || st->state == STRIPE_BODY) {
+    if (st->state == STRIPE_HEAD) {
+      p = (unsigned char *)st->hdr + st->off;
+      want = sizeof(st->hdr) - st->off;
+    } else {
+      p = st->buf + st->off;
+      want = st->len - st->off;
+    }
+    if ((n = read(st->fd, p, want)) <= 0) {
+      if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return (0);
+      if (n < 0)
+        warn("read");
+      else
+        warnx("connection %d of the striped transfer closed early", i);
+      return (-1);
+    }
+    st->off += n;
+    if (st->state == STRIPE_BODY) {
+      if (st->off == st->len)
+        st->state = STRIPE_READY;
+      continue;
+    }
+    if (st->off < sizeof(st->hdr))
+      continue;
+
+    /* A whole header is in. */
+    st->seq = (unsigned long long)ntohl(st->hdr[0]) << 32 | ntohl(st->hdr[1]);
+    st->len = ntohl(st->hdr[2]);
+    st->off = 0;
+    if (st->len > chunk) {
+      warnx("chunk of %zu bytes on connection %d is too large", st->len, i);
+      return (-1);
+    }
+    st->state = st->len ? STRIPE_BODY : STRIPE_END;
+  }
+  return (0);
+}
+
+/*
+ * stripe_recv()
+ * Take one striped transfer on the listening socket s and write its
+ * chunks to stdout in order. A connection holds at most one chunk that
+ * is not next yet, and is not read again until it has been written, so
+ * memory stays at one chunk per connection. Returns 0 on success, 1 if
+ * the transfer broke off.
+ */
+int stripe_recv(int s, char *path) {
+  struct stripe *st;
+  struct pollfd *pfd;
+  unsigned long long seq = 0, bytes = 0;
+  long long start;
+  size_t chunk;
+  int i, n, done, ret = 1, lfd = fileno(stdout);
+
+  if ((st = calloc(Yflag, sizeof(*st))) == NULL ||
+      (pfd = calloc(Yflag, sizeof(*pfd))) == NULL)
+    err(1, NULL);
+  for (i = 0; i < Yflag; i++)
+    st[i].fd = -1;
+  chunk = stripe_accept(s, path, st);
+  for (i = 0; i < Yflag; i++) {
+    if ((st[i].buf = malloc(chunk)) == NULL)
+      err(1, NULL);
+    (void)set_nonblock(st[i].fd);
+  }
+
+  start = monotime_us();
+  for (;;) {
+    /* Write out every chunk that is next in order. */
+    do {
+      done = 0;
+      for (i = 0; i < Yflag; i++) {
+        if (st[i].state != STRIPE_READY || st[i].seq != seq)
+          continue;
+        if (atomicio(vwrite, lfd, st[i].buf, st[i].len) != st[i].len)
+          goto out;
+        bytes += st[i].len;
+        seq++;
+        st[i].state = STRIPE_HEAD;
+        st[i].off = 0;
+        if (stripe_read(&st[i], chunk, i) < 0)
+          goto out;
+        done = 1;
+      }
+    } while (done);
+
+    for (i = 0, n = 0; i < Yflag; i++) {
+      pfd[i].fd = st[i].state < STRIPE_READY ? st[i].fd : -1;
+      pfd[i].events = POLLIN;
+      n += st[i].state == STRIPE_END;
+    }
+    if (n == Yflag)
+      break;
+    if ((n = poll(pfd, Yflag, timeout)) < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "Polling Error");
+    }
+    if (n == 0)
+      goto out;
+    for (i = 0; i < Yflag; i++) {
+      if (pfd[i].revents && stripe_read(&st[i], chunk, i) < 0)
+        goto out;
+    }
+  }
+
+  /* Every end carries the chunk count, which must all have come. */
+  for (i = 0; i < Yflag; i++) {
+    if (st[i].seq != seq) {
+      warnx("striped transfer ended with chunks missing");
+      goto out;
+    }
+  }
+  stripe_report("recv", bytes, seq, start);
+  ret = 0;
+
+out:
+  for (i = 0; i < Yflag; i++) {
+    if (st[i].fd != -1)
+      close(st[i].fd);
+    free(st[i].buf);
+  }
+  free(st);
+  free(pfd);
+  return (ret);
+}
+
 /*
  * unix_connect()
  * Returns a socket connected to a local unix socket. Returns -1 on failure.
@@ -480,7 +1339,7 @@ int unix_listen(char *path) {
     return (-1);
   }
 
-  if (listen(s, 5) < 0) {
+  if (listen(s, bflag != -1 ? bflag : 5) < 0) {
     close(s);
     return (-1);
   }
@@ -500,300 +1359,2831 @@ char *proto_name(int uflag) {
 }
 
 /*
- * remote_connect()
- * Returns a socket connected to a remote host. Properly binds to a local
- * port or source address if needed. Returns -1 on failure.
+ * Name lookups are done once per host and cached, without a port; each
+ * port is then swapped into a copy of the cached addresses, so scanning a
+ * range costs one lookup rather than one per port. Lookups can be started
+ * early on a thread of their own so that several hosts (target, source
+ * address, proxy) resolve in parallel.
  */
-int remote_connect(const char *host, const char *port, struct addrinfo hints) {
-  struct addrinfo *res, *res0;
-  int s, error;
+struct resolve_entry {
+  struct resolve_entry *next;
+  char *host;            /* NULL for a wildcard address */
+  struct addrinfo hints; /* Only family, socktype, protocol and flags */
+  pthread_t thread;
+  int pending;           /* thread still has to be joined */
+  int error;             /* getaddrinfo() result */
+  struct addrinfo *res;
+};
+
+static struct resolve_entry *resolve_cache;
+
+static void *resolve_thread(void *arg) {
+  struct resolve_entry *re = arg;
+
+  re->error = getaddrinfo(re->host, "0", &re->hints, &re->res);
+  return (NULL);
+}
 
-  if ((error = getaddrinfo(host, port, &hints, &res)))
-    errx(1, "getaddrinfo: %s", gai_strerror(error));
+static struct resolve_entry *resolve_find(const char *host,
+                                          const struct addrinfo *hints) {
+  struct resolve_entry *re;
 
-  res0 = res;
-  do {
-    if ((s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) < 0)
+  for (re = resolve_cache; re != NULL; re = re->next) {
+    if ((re->host == NULL) != (host == NULL) ||
+        (host != NULL && strcmp(re->host, host) != 0))
       continue;
+    if (re->hints.ai_family == hints->ai_family &&
+        re->hints.ai_socktype == hints->ai_socktype &&
+        re->hints.ai_protocol == hints->ai_protocol &&
+        re->hints.ai_flags == hints->ai_flags)
+      return (re);
+  }
+  return (NULL);
+}
 
-    /* Bind to a local port or source address if specified. */
-    if (sflag || pflag) {
-      struct addrinfo ahints, *ares;
+/*
+ * resolve_start()
+ * Begin looking up host in the background, unless it is already cached.
+ */
+void resolve_start(const char *host, const struct addrinfo *hints) {
+  struct resolve_entry *re;
 
-      memset(&ahints, 0, sizeof(struct addrinfo));
-      ahints.ai_family = res->ai_family;
-      ahints.ai_socktype = uflag ? SOCK_DGRAM : SOCK_STREAM;
-      ahints.ai_protocol = uflag ? IPPROTO_UDP : IPPROTO_TCP;
-      ahints.ai_flags = AI_PASSIVE;
-      if ((error = getaddrinfo(sflag, pflag, &ahints, &ares)))
-        errx(1, "getaddrinfo: %s", gai_strerror(error));
+  if (resolve_find(host, hints) != NULL)
+    return;
+  if ((re = calloc(1, sizeof(*re))) == NULL)
+    err(1, NULL);
+  if (host != NULL && (re->host = strdup(host)) == NULL)
+    err(1, NULL);
+  re->hints.ai_family = hints->ai_family;
+  re->hints.ai_socktype = hints->ai_socktype;
+  re->hints.ai_protocol = hints->ai_protocol;
+  re->hints.ai_flags = hints->ai_flags;
+  if (pthread_create(&re->thread, NULL, resolve_thread, re) == 0)
+    re->pending = 1;
+  else
+    (void)resolve_thread(re);
+  re->next = resolve_cache;
+  resolve_cache = re;
+}
 
-      if (bind(s, (struct sockaddr *)ares->ai_addr, ares->ai_addrlen) < 0)
-        errx(1, "bind failed: %s", strerror(errno));
-      freeaddrinfo(ares);
+/*
+ * resolve()
+ * getaddrinfo() for host and port backed by the cache. A port that is not
+ * numeric is looked up directly. Returns 0 or a getaddrinfo() error; *res
+ * must be released with resolve_free().
+ */
+int resolve(const char *host, const char *port, const struct addrinfo *hints,
+            struct addrinfo **res) {
+  struct resolve_entry *re = NULL;
+  struct addrinfo *ai, *lookup, *copy;
+  struct sockaddr_storage *ss;
+  int n, error;
+  in_port_t nport = 0;
+
+  if (port == NULL || port[strspn(port, "0123456789")] == '\0') {
+    nport = htons(port != NULL ? atoi(port) : 0);
+    resolve_start(host, hints);
+    re = resolve_find(host, hints);
+    if (re->pending) {
+      pthread_join(re->thread, NULL);
+      re->pending = 0;
     }
+    if (re->error)
+      return (re->error);
+    lookup = re->res;
+  } else if ((error = getaddrinfo(host, port, hints, &lookup)))
+    return (error);
+
+  /* One allocation holds the list and its addresses. */
+  for (n = 0, ai = lookup; ai != NULL; ai = ai->ai_next)
+    n++;
+  if ((copy = calloc(n, sizeof(*copy) + sizeof(*ss))) == NULL)
+    err(1, NULL);
+  ss = (struct sockaddr_storage *)(copy + n);
+  for (n = 0, ai = lookup; ai != NULL; ai = ai->ai_next, n++) {
+    copy[n] = *ai;
+    copy[n].ai_canonname = NULL;
+    copy[n].ai_addr = (struct sockaddr *)&ss[n];
+    copy[n].ai_next = ai->ai_next != NULL ? &copy[n + 1] : NULL;
+    memcpy(&ss[n], ai->ai_addr, ai->ai_addrlen);
+    if (re == NULL)
+      continue;
+    if (ss[n].ss_family == AF_INET)
+      ((struct sockaddr_in *)&ss[n])->sin_port = nport;
+    else if (ss[n].ss_family == AF_INET6)
+      ((struct sockaddr_in6 *)&ss[n])->sin6_port = nport;
+  }
+  if (re == NULL)
+    freeaddrinfo(lookup);
 
-    set_common_sockopts(s);
-    char *proto = proto_name(uflag);
-
-    if ((error = connect_with_timeout(s, res0->ai_addr, res0->ai_addrlen,
-                                      timeout)) == CONNECTION_SUCCESS) {
-      break;
-    } else if (vflag && error == CONNECTION_FAILED) {
-      warn("connect to %s port %s (%s) failed", host, port, proto);
-    } else if (vflag && error == CONNECTION_TIMEOUT) {
-      warn("connect to %s port %s (%s) timed out", host, port, proto);
-    }
+  *res = copy;
+  return (0);
+}
 
-    close(s);
-    s = -1;
-  } while ((res0 = res0->ai_next) != NULL);
+void resolve_free(struct addrinfo *res) { free(res); }
 
-  freeaddrinfo(res);
+/* Microseconds the last remote_connect() took, reported with -F. */
+static long long connect_us;
 
-  return (s);
-}
+/*
+ * remote_connect()
+ * Returns a socket connected to a remote host. Properly binds to a local
+ * port or source address if needed. Returns -1 on failure.
+ *
+ * Addresses are tried Happy Eyeballs style (RFC 8305): alternating between
+ * address families, a new attempt is started every CONNECT_ATTEMPT_DELAY
+ * or as soon as the previous one fails, without abandoning the ones still
+ * in progress. The first attempt to complete wins.
+ */
+int remote_connect(const char *host, const char *port, struct addrinfo hints) {
+  struct addrinfo *res, **ai;
+  struct pollfd *pfd;
+  long long *deadline, now, nextstart, wait, begin;
+  const char *proto = proto_name(uflag);
+  int i, n, s, error, next, active;
+  socklen_t len;
+
+  if ((error = resolve(host, port, &hints, &res)))
+    errx(1, "getaddrinfo: %s", gai_strerror(error));
+
+  n = interleave_addrs(res, &ai);
+  begin = monotime_us();
+#ifdef HAVE_IO_URING
+  if (aflag && (s = uring_race(ai, n, host, port)) != -2) {
+    connect_us = monotime_us() - begin;
+    free(ai);
+    resolve_free(res);
+    return (s);
+  }
+#endif
+  if ((pfd = calloc(n, sizeof(*pfd))) == NULL ||
+      (deadline = calloc(n, sizeof(*deadline))) == NULL)
+    err(1, NULL);
+  for (i = 0; i < n; i++) {
+    pfd[i].fd = -1;
+    pfd[i].events = POLLOUT;
+  }
+
+  s = -1;
+  next = active = 0;
+  nextstart = 0;
+  while (s == -1 && (next < n || active > 0)) {
+    now = monotime_ms();
+
+    /* Start the next attempt if it is due. */
+    if (next < n && (active == 0 || now >= nextstart)) {
+      i = next++;
+      /* An attempt that fails at once lets the next one start at once. */
+      nextstart = now;
+      if ((pfd[i].fd = socket(ai[i]->ai_family, ai[i]->ai_socktype,
+                              ai[i]->ai_protocol)) < 0)
+        continue;
+
+      /* Bind to a local port or source address if specified. */
+      if (sflag || pflag)
+        source_bind(pfd[i].fd, ai[i]->ai_family);
+
+      set_common_sockopts(pfd[i].fd);
+
+      (void)set_nonblock(pfd[i].fd);
+      if (connect(pfd[i].fd, ai[i]->ai_addr, ai[i]->ai_addrlen) == 0) {
+        s = pfd[i].fd;
+        pfd[i].fd = -1;
+        break;
+      }
+      if (errno == EINPROGRESS) {
+        deadline[i] = timeout > 0 ? now + timeout : 0;
+        nextstart = now + CONNECT_ATTEMPT_DELAY;
+        active++;
+        continue;
+      }
+      if (vflag)
+        warn("connect to %s port %s (%s) failed", host, port, proto);
+      close(pfd[i].fd);
+      pfd[i].fd = -1;
+      continue;
+    }
+
+    wait = next < n ? nextstart - now : -1;
+    for (i = 0; i < next; i++) {
+      if (pfd[i].fd != -1 && deadline[i] != 0 &&
+          (wait == -1 || deadline[i] - now < wait))
+        wait = deadline[i] - now;
+    }
+    if (poll(pfd, next, (int)MAX(wait, 0)) < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "poll");
+    }
+
+    now = monotime_ms();
+    for (i = 0; i < next && s == -1; i++) {
+      if (pfd[i].fd == -1)
+        continue;
+      if (pfd[i].revents) {
+        len = sizeof(error);
+        if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+          error = errno;
+        if (error == 0) {
+          s = pfd[i].fd;
+          pfd[i].fd = -1;
+          break;
+        }
+        errno = error;
+        if (vflag)
+          warn("connect to %s port %s (%s) failed", host, port, proto);
+      } else if (deadline[i] != 0 && now >= deadline[i]) {
+        if (vflag)
+          warnx("connect to %s port %s (%s) timed out", host, port, proto);
+      } else
+        continue;
+
+      /* Don't wait out the attempt delay after a failure. */
+      close(pfd[i].fd);
+      pfd[i].fd = -1;
+      active--;
+      nextstart = now;
+    }
+  }
+
+  /* Abandon the attempts that lost the race. */
+  for (i = 0; i < next; i++) {
+    if (pfd[i].fd != -1)
+      close(pfd[i].fd);
+  }
+  if (s != -1)
+    (void)fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) & ~O_NONBLOCK);
+  connect_us = monotime_us() - begin;
+
+  free(pfd);
+  free(deadline);
+  free(ai);
+  resolve_free(res);
+
+  return (s);
+}
+
+/*
+ * interleave_addrs()
+ * Order the getaddrinfo() results for remote_connect(), alternating
+ * between the first address family and the others as RFC 8305 suggests.
+ * Returns the number of addresses stored in the allocated array *out.
+ */
+static int interleave_addrs(struct addrinfo *res, struct addrinfo ***out) {
+  struct addrinfo *a, *b, **ai;
+  int n, i;
+
+  for (n = 0, a = res; a != NULL; a = a->ai_next)
+    n++;
+  if ((ai = calloc(n, sizeof(*ai))) == NULL)
+    err(1, NULL);
+
+  /* a walks the first family, b everything else. */
+  a = b = res;
+  for (i = 0; i < n;) {
+    while (a != NULL && a->ai_family != res->ai_family)
+      a = a->ai_next;
+    if (a != NULL) {
+      ai[i++] = a;
+      a = a->ai_next;
+    }
+    while (b != NULL && b->ai_family == res->ai_family)
+      b = b->ai_next;
+    if (b != NULL) {
+      ai[i++] = b;
+      b = b->ai_next;
+    }
+  }
+  *out = ai;
+  return (n);
+}
+
+/*
+ * source_hints()
+ * The getaddrinfo() hints used to look up the -s address.
+ */
+static void source_hints(struct addrinfo *ahints) {
+  memset(ahints, 0, sizeof(struct addrinfo));
+  ahints->ai_family = family;
+  ahints->ai_socktype = uflag ? SOCK_DGRAM : SOCK_STREAM;
+  ahints->ai_protocol = uflag ? IPPROTO_UDP : IPPROTO_TCP;
+  ahints->ai_flags = AI_PASSIVE;
+}
+
+/*
+ * source_bind()
+ * Bind s to the -s address and/or -p port for address family af.
+ */
+static void source_bind(int s, int af) {
+  struct addrinfo ahints, *ares, *ai;
+  int error;
+
+  source_hints(&ahints);
+  if ((error = resolve(sflag, pflag, &ahints, &ares)))
+    errx(1, "getaddrinfo: %s", gai_strerror(error));
+
+  for (ai = ares; ai != NULL && ai->ai_family != af; ai = ai->ai_next)
+    ;
+  if (ai == NULL)
+    errx(1, "bind failed: %s", strerror(EAFNOSUPPORT));
+  if (bind(s, (struct sockaddr *)ai->ai_addr, ai->ai_addrlen) < 0)
+    errx(1, "bind failed: %s", strerror(errno));
+  resolve_free(ares);
+}
+
+/*
+ * report_connect()
+ * Print the "succeeded" line for a scanned or verbose connection.
+ */
+static void report_connect(const char *host, const char *port) {
+  struct servent *sv = NULL;
+
+  /* Don't look up port if -n. */
+  if (!nflag)
+    sv = getservbyport(ntohs(atoi(port)), uflag ? "udp" : "tcp");
+
+  fprintf(stderr,
+          "Connection to %s %s port [%s/%s] "
+          "succeeded!\n",
+          host, port, uflag ? "udp" : "tcp", sv ? sv->s_name : "*");
+}
+
+/*
+ * fastopen_kick()
+ * A Fast Open connect waits for data before sending its SYN. Called once
+ * nothing more will be written to s, so that the connection is made even
+ * if stdin had nothing to send.
+ */
+static void fastopen_kick(int s) {
+#ifdef TCP_FASTOPEN_CONNECT
+  if (Fflag && !lflag)
+    (void)send(s, NULL, 0, MSG_NOSIGNAL);
+#endif
+}
+
+/*
+ * report_fastopen()
+ * With -F and -v, tell whether data went in the SYN of connection s and,
+ * for a client, how long the connect took.
+ */
+static void report_fastopen(int s) {
+#ifdef TCPI_OPT_SYN_DATA
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+
+  if (!Fflag || !vflag || getsockopt(s, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+    return;
+  fprintf(stderr, "TCP Fast Open %s",
+          ti.tcpi_options & TCPI_OPT_SYN_DATA ? "used" : "not used");
+  if (!lflag)
+    fprintf(stderr, ", connect %.3f ms, rtt %.3f ms", connect_us / 1000.0,
+            ti.tcpi_rtt / 1000.0);
+  fprintf(stderr, "\n");
+#endif
+}
+
+/*
+ * Milliseconds on the monotonic clock, for connect deadlines.
+ */
+static long long monotime_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Microseconds on the monotonic clock, for transfer statistics.
+ */
+static long long monotime_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Nanoseconds on the monotonic clock, for -L pacing.
+ */
+static long long monotime_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * poll_ns()
+ * poll() with a timeout in nanoseconds, -1 for none. Pacing at high
+ * rates needs waits much shorter than a millisecond; without ppoll()
+ * the wait is rounded up.
+ */
+static int poll_ns(struct pollfd *pfd, nfds_t n, long long ns) {
+#ifdef __linux__
+  struct timespec ts;
+
+  if (ns < 0)
+    return (ppoll(pfd, n, NULL, NULL));
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  return (ppoll(pfd, n, &ts, NULL));
+#else
+  return (poll(pfd, n, ns < 0 ? -1 : (int)((ns + 999999) / 1000000)));
+#endif
+}
+
+/* A port being probed by scan_ports(). */
+struct scan {
+  int fd;                  /* Socket with a connect in progress, or -1 */
+  const char *port;        /* Entry of portlist[] */
+  struct addrinfo *res;    /* Addresses for host and port, or the proxy */
+  struct addrinfo *ai;     /* Address currently being tried */
+  long long deadline;      /* Give up on ai at this time, 0 for never */
+  struct socks_hs *hs;     /* Handshake once connected to the -x proxy */
+  short events;            /* What hs waits for */
+};
+
+/*
+ * scan_next()
+ * Start a non-blocking connect to the next address of sc. Returns
+ * CONNECTION_SUCCESS if one completed at once, CONNECTION_TIMEOUT while a
+ * connect is in progress and CONNECTION_FAILED when no address is left.
+ */
+static int scan_next(struct scan *sc, const char *host) {
+  const char *proto = proto_name(uflag);
+
+  for (; sc->ai != NULL; sc->ai = sc->ai->ai_next) {
+    if ((sc->fd = socket(sc->ai->ai_family, sc->ai->ai_socktype,
+                         sc->ai->ai_protocol)) < 0)
+      continue;
+    (void)set_nonblock(sc->fd);
+    if (sflag || pflag)
+      source_bind(sc->fd, sc->ai->ai_family);
+    set_common_sockopts(sc->fd);
+
+    if (connect(sc->fd, sc->ai->ai_addr, sc->ai->ai_addrlen) == 0)
+      return (CONNECTION_SUCCESS);
+    if (errno == EINPROGRESS) {
+      sc->deadline = timeout > 0 ? monotime_ms() + timeout : 0;
+      return (CONNECTION_TIMEOUT);
+    }
+    if (vflag)
+      warn("connect to %s port %s (%s) failed", host, sc->port, proto);
+    close(sc->fd);
+    sc->fd = -1;
+  }
+  return (CONNECTION_FAILED);
+}
+
+/*
+ * scan_done()
+ * Finish with sc: report it if it connected and release its resources.
+ */
+static void scan_done(struct scan *sc, const char *host, int result) {
+  if (result == CONNECTION_SUCCESS)
+    report_connect(host, sc->port);
+  if (sc->hs != NULL)
+    socks_free(sc->hs);
+  if (sc->fd != -1)
+    close(sc->fd);
+  resolve_free(sc->res);
+  memset(sc, 0, sizeof(*sc));
+  sc->fd = -1;
+}
+
+/*
+ * scan_step()
+ * Move the proxy handshake of sc along. Returns like scan_next().
+ */
+static int scan_step(struct scan *sc, const char *host) {
+  const char *why;
+  int n;
+
+  if ((n = socks_step(sc->hs, &sc->events, &why)) == 1)
+    return (CONNECTION_TIMEOUT);
+  if (n == 0)
+    return (CONNECTION_SUCCESS);
+  if (vflag)
+    warnx("connect to %s port %s (%s) via proxy failed: %s", host, sc->port,
+          proto_name(uflag), why);
+  return (CONNECTION_FAILED);
+}
+
+/*
+ * scan_proxy()
+ * With -x, sc has connected to the proxy: ask it for the port, under a
+ * new -w deadline. Returns like scan_next().
+ */
+static int scan_proxy(struct scan *sc, const char *host, int socksv) {
+  if (!xflag)
+    return (CONNECTION_SUCCESS);
+  sc->hs = socks_start(sc->fd, host, sc->port, socksv, Pflag);
+  sc->deadline = timeout > 0 ? monotime_ms() + timeout : 0;
+  return (scan_step(sc, host));
+}
 
-static int connect_with_timeout(int fd, const struct sockaddr *sa,
-                                socklen_t salen, int ctimeout) {
-  int err;
-  struct timeval tv, *tvp = NULL;
-  fd_set connect_fdset;
+/*
+ * scan_ports()
+ * Connect scan of every port in portlist[], keeping up to mflag
+ * non-blocking connects in flight. Each address attempt has its own -w
+ * deadline and results are printed as they complete. With -x, each
+ * connect goes to the proxy and runs its handshake without blocking.
+ * With -i, a new connect is started at most every iflag seconds.
+ * Returns 0 if any port accepted a connection, 1 otherwise.
+ */
+int scan_ports(const char *host, struct addrinfo hints, const char *proxyhost,
+               const char *proxyport, struct addrinfo proxyhints, int socksv) {
+  const char *proto = proto_name(uflag);
+  struct scan *sc;
+  struct pollfd *pfd;
+  long long now, wait, paced = 0;
+  int i, n, error, active = 0, next = 0, ret = 1;
   socklen_t len;
-  int orig_flags;
 
-  orig_flags = fcntl(fd, F_GETFL, 0);
-  if (fcntl(fd, F_SETFL, orig_flags | O_NONBLOCK) < 0) {
-    warn("can't set O_NONBLOCK - timeout not avaliable");
-    if (connect(fd, sa, salen) == 0)
-      return CONNECTION_SUCCESS;
+  if ((sc = calloc(mflag, sizeof(*sc))) == NULL ||
+      (pfd = calloc(mflag, sizeof(*pfd))) == NULL)
+    err(1, NULL);
+  for (i = 0; i < mflag; i++)
+    sc[i].fd = -1;
+
+  /* Every port goes through the proxy, with the password asked once. */
+  if (xflag) {
+    if (proxyport == NULL)
+      proxyport = socks_port(socksv);
+    if (Pflag && socksv == -1)
+      socks_password(Pflag, proxyhost);
+  }
+
+  for (;;) {
+    /* Fill the free slots from portlist[]. */
+    for (i = 0; i < mflag && portlist[next] != NULL; i++) {
+      if (sc[i].res != NULL)
+        continue;
+      if (iflag) {
+        if ((now = monotime_ms()) < paced)
+          break;
+        paced = now + iflag * 1000LL;
+      }
+      sc[i].port = portlist[next++];
+      if (xflag)
+        error = resolve(proxyhost, proxyport, &proxyhints, &sc[i].res);
+      else
+        error = resolve(host, sc[i].port, &hints, &sc[i].res);
+      if (error)
+        errx(1, "getaddrinfo: %s", gai_strerror(error));
+      sc[i].ai = sc[i].res;
+      if ((n = scan_next(&sc[i], host)) == CONNECTION_SUCCESS)
+        n = scan_proxy(&sc[i], host, socksv);
+      if (n == CONNECTION_TIMEOUT) {
+        active++;
+        continue;
+      }
+      if (n == CONNECTION_SUCCESS)
+        ret = 0;
+      scan_done(&sc[i], host, n);
+      i--; /* Reuse the slot */
+    }
+    if (active == 0 && portlist[next] == NULL)
+      break;
+
+    wait = -1;
+    now = monotime_ms();
+    /* Wake up for the next start -i allows while a slot is free. */
+    if (iflag && portlist[next] != NULL && active < mflag)
+      wait = MAX(paced - now, 0);
+    for (i = 0; i < mflag; i++) {
+      pfd[i].fd = sc[i].res != NULL ? sc[i].fd : -1;
+      pfd[i].events = sc[i].hs != NULL ? sc[i].events : POLLOUT;
+      if (pfd[i].fd != -1 && sc[i].deadline != 0 &&
+          (wait == -1 || sc[i].deadline - now < wait))
+        wait = MAX(sc[i].deadline - now, 0);
+    }
+
+    if (poll(pfd, mflag, (int)wait) < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "poll");
+    }
+
+    now = monotime_ms();
+    for (i = 0; i < mflag; i++) {
+      if (pfd[i].fd == -1)
+        continue;
+      if (sc[i].hs != NULL) {
+        /* A proxy that fails for the port fails the port. */
+        if (pfd[i].revents)
+          n = scan_step(&sc[i], host);
+        else if (sc[i].deadline != 0 && now >= sc[i].deadline) {
+          if (vflag)
+            warnx("connect to %s port %s (%s) via proxy timed out", host,
+                  sc[i].port, proto);
+          n = CONNECTION_FAILED;
+        } else
+          continue;
+      } else {
+        if (pfd[i].revents) {
+          len = sizeof(error);
+          if (getsockopt(sc[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+            error = errno;
+          errno = error;
+          if (error != 0 && vflag)
+            warn("connect to %s port %s (%s) failed", host, sc[i].port,
+                 proto);
+        } else if (sc[i].deadline != 0 && now >= sc[i].deadline) {
+          error = ETIMEDOUT;
+          if (vflag)
+            warnx("connect to %s port %s (%s) timed out", host, sc[i].port,
+                  proto);
+        } else
+          continue;
+
+        if (error == 0)
+          n = scan_proxy(&sc[i], host, socksv);
+        else {
+          /* This address failed; move on to the next one for the port. */
+          close(sc[i].fd);
+          sc[i].fd = -1;
+          sc[i].ai = sc[i].ai->ai_next;
+          if ((n = scan_next(&sc[i], host)) == CONNECTION_SUCCESS)
+            n = scan_proxy(&sc[i], host, socksv);
+        }
+      }
+      if (n == CONNECTION_TIMEOUT)
+        continue;
+      active--;
+      if (n == CONNECTION_SUCCESS)
+        ret = 0;
+      scan_done(&sc[i], host, n);
+    }
+  }
+
+  free(sc);
+  free(pfd);
+  return (ret);
+}
+
+/*
+ * local_listen()
+ * Returns a socket listening on a local port, binds to specified source
+ * address. Returns -1 on failure.
+ */
+int local_listen(char *host, char *port, struct addrinfo hints) {
+  struct addrinfo *res, *res0;
+  int s, ret, x = 1;
+  int error;
+
+  /* Allow nodename to be null. */
+  hints.ai_flags |= AI_PASSIVE;
+
+  /*
+   * In the case of binding to a wildcard address
+   * default to binding to an ipv4 address.
+   */
+  if (host == NULL && hints.ai_family == AF_UNSPEC)
+    hints.ai_family = AF_INET;
+
+  if ((error = getaddrinfo(host, port, &hints, &res)))
+    errx(1, "getaddrinfo: %s", gai_strerror(error));
+
+  res0 = res;
+  do {
+    if ((s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) < 0)
+      continue;
+
+    ret = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &x, sizeof(x));
+    if (ret == -1)
+      err(1, NULL);
+#ifdef SO_REUSEPORT
+    ret = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &x, sizeof(x));
+    if (ret == -1)
+      err(1, NULL);
+#endif
+    set_common_sockopts(s);
+#ifdef TCP_FASTOPEN
+    /* Take data in the SYN from as many clients as the backlog holds. */
+    if (Fflag) {
+      int qlen = bflag != -1 ? bflag : (kflag ? SOMAXCONN : 1);
+
+      if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1)
+        err(1, "set TCP Fast Open");
+    }
+#endif
+
+    if (bind(s, (struct sockaddr *)res0->ai_addr, res0->ai_addrlen) == 0)
+      break;
+
+    close(s);
+    s = -1;
+  } while ((res0 = res0->ai_next) != NULL);
+
+  if (!uflag && s != -1) {
+    if (listen(s, bflag != -1 ? bflag : (kflag ? SOMAXCONN : 1)) < 0)
+      err(1, "listen");
+  }
+
+  if (vflag && s != -1) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+
+    len = sizeof(ss);
+    if (getsockname(s, (struct sockaddr *)&ss, &len) == -1)
+      err(1, "getsockname");
+    report_sock(uflag ? "Bound" : "Listening", (struct sockaddr *)&ss, len,
+                NULL);
+  }
+
+  freeaddrinfo(res);
+
+  return (s);
+}
+
+/*
+ * One direction of the relay run by readwrite(). Bytes are queued from
+ * rfd and drained to wfd, either through a user space ring buffer or,
+ * where the descriptors allow it, through a pipe with splice() or
+ * straight from a file with sendfile().
+ */
+struct relay {
+  int rfd;            /* Source, -1 once the direction is unused */
+  int wfd;            /* Destination */
+  int mode;           /* RELAY_COPY, RELAY_SPLICE or RELAY_SENDFILE */
+  int eof;            /* Nothing more will be read from rfd */
+  int crlf;           /* Turn LF into CRLF: 1, or 2 to skip CRLF (-C) */
+  int cr;             /* The last byte read was a CR */
+  int telnet;         /* Answer telnet negotiation on rfd (-t) */
+  struct telnet tn;   /* Negotiation state of rfd with -t */
+  int cork;           /* TCP_CORK wfd while sending in bulk (-o cork) */
+  int corked;         /* TCP_CORK is set on wfd */
+  z_stream *z;        /* zlib between rfd and buf (-Z), or NULL */
+  int zdeflate;       /* z compresses rather than decompresses */
+  unsigned char *zin; /* Bytes read from rfd for z */
+  int zeof;           /* rfd is exhausted, z may still have output */
+  int zflush;         /* Z_SYNC_FLUSH or Z_FINISH under way, or 0 */
+  long long zdue;     /* monotime_ns() by which z must flush, or 0 */
+  unsigned char *buf; /* Ring buffer */
+  size_t size;        /* Capacity of buf */
+  size_t off;         /* Start of queued bytes in buf */
+  size_t len;         /* Bytes queued in buf */
+  int pipe[2];        /* Kernel buffer for RELAY_SPLICE */
+  size_t pipesize;    /* Capacity of pipe */
+  size_t piped;       /* Bytes queued in pipe */
+  /* Statistics for -R */
+  unsigned long long bytes; /* Bytes written to wfd */
+  unsigned long long mark;  /* bytes at the last progress line */
+  unsigned long reads;      /* System calls reading the source */
+  unsigned long writes;     /* System calls writing the destination */
+  unsigned long wakeups;    /* Polls that found the direction ready */
+  long long start;          /* monotime_us() when the relay began */
+  long long idle;           /* Microseconds polled waiting for input */
+  long long stalled;        /* Microseconds polled with bytes queued */
+  /* Token bucket for -L */
+  double rate;      /* Bytes or writes per second, 0 for no limit */
+  int per_write;    /* rate counts writes rather than bytes */
+  size_t most;      /* Largest write per token, 0 for any (-i) */
+  double tokens;    /* What may be written now; below 0 after a datagram */
+  long long refill; /* monotime_ns() when tokens was last topped up */
+  /* Checksum for -H */
+  int hash;                    /* HASH_SEND to HASH_DONE, or 0 */
+  uint32_t crc;                /* CRC32C of the stream so far */
+  unsigned long long hashed;   /* Bytes in crc */
+  int verdict;                 /* 1 matched, 0 none, -1 bad, -2 missing */
+  size_t frame;                /* Data left in the frame of the peer */
+  /* Hello, frame header or trailer of the peer, as it arrives */
+  unsigned char hdr[HASH_TRAILER];
+  size_t got;                  /* Bytes of hdr read so far */
+  uint32_t peer_crc;           /* CRC32C the trailer carried */
+  unsigned long long peer_len; /* Length the trailer carried */
+#ifdef MSG_WAITFORONE
+  int sock;              /* RELAY_DGRAM: the UDP socket, rfd or wfd */
+  struct mmsghdr *msgs;  /* RELAY_DGRAM: one datagram per slot */
+  struct iovec *iov;     /* Slot buffers, one per message */
+  unsigned char *cmsg;   /* Control buffers for UDP_GRO, one per slot */
+  size_t slot;           /* Bytes per slot */
+  int gso;               /* UDP_SEGMENT size of sock, 0 if unused */
+  int gro;               /* Slots may hold UDP_GRO trains */
+  unsigned int nslots;   /* Slots in msgs */
+  unsigned int head;     /* First slot not yet written */
+  unsigned int count;    /* Slots filled by the last batch */
+  unsigned long batches; /* recvmmsg()/sendmmsg() calls made on sock */
+  unsigned long dgrams;  /* Datagrams they moved */
+#endif
+#ifdef HAVE_IO_URING
+  int index;      /* RELAY_URING: first registered buffer, or -1 */
+  int reading;    /* A read into buf is in flight */
+  int writing;    /* A write from buf is in flight */
+  int front;      /* Half of buf written next */
+  int filled;     /* Halves of buf holding data */
+  size_t half[2]; /* Bytes read into each half */
+#endif
+};
+
+#define RELAY_COPY 0
+#define RELAY_SPLICE 1
+#define RELAY_SENDFILE 2
+#define RELAY_DGRAM 3
+#define RELAY_URING 4
+
+/*
+ * A -H sender starts with HASH_MAGIC, then sends what it reads in frames:
+ * a 32-bit length and that many bytes. A frame of length 0 ends the data
+ * and is followed by the 64-bit length and the CRC32C of all of it, all
+ * in network byte order. The receiver cuts the framing out as it arrives,
+ * so it never has to guess where the data ends or hold any of it back.
+ */
+#define HASH_SEND 1  /* Frame the data and send a trailer after it */
+#define HASH_HELLO 2 /* Wait for HASH_MAGIC from the peer */
+#define HASH_CHECK 3 /* Take frames apart and check the trailer */
+#define HASH_DONE 4  /* The trailer of the peer has been checked */
+
+static int stdin_flags = -1, stdout_flags = -1;
+
+/* The directions of the running readwrite(), for quit() to report on. */
+static struct relay *relay_in, *relay_out;
+
+/* Bytes read from a socket before readwrite() began, see relay_preload(). */
+static int preload_fd = -1;
+static unsigned char *preload;
+static size_t preload_len;
+
+/*
+ * set_nonblock()
+ * Put fd in non-blocking mode and return its previous flags, or -1.
+ */
+static int set_nonblock(int fd) {
+  int flags;
+
+  if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+    return (-1);
+  if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return (-1);
+  return (flags);
+}
+
+/*
+ * restore_stdio()
+ * Undo set_nonblock() on stdin and stdout, which are shared with the
+ * parent shell.
+ */
+static void restore_stdio(void) {
+  if (stdin_flags != -1)
+    (void)fcntl(fileno(stdin), F_SETFL, stdin_flags);
+  if (stdout_flags != -1)
+    (void)fcntl(fileno(stdout), F_SETFL, stdout_flags);
+  stdin_flags = stdout_flags = -1;
+}
+
+static void relay_init(struct relay *r, int rfd, int wfd, int mode) {
+  memset(r, 0, sizeof(*r));
+  r->rfd = rfd;
+  r->wfd = wfd;
+  r->mode = mode;
+  r->pipe[0] = r->pipe[1] = -1;
+  r->start = monotime_us();
+  r->size = Bflag;
+  if ((r->buf = malloc(r->size)) == NULL)
+    err(1, NULL);
+#ifdef SPLICE_F_MOVE
+  if (r->mode == RELAY_SPLICE && splice_pipe(r->pipe, &r->pipesize) < 0)
+    r->mode = RELAY_COPY;
+#endif
+}
+
+/*
+ * relay_zinit()
+ * Put zlib between the source of r and its ring buffer (-Z): deflate at
+ * level, or inflate if level is 0.
+ */
+static void relay_zinit(struct relay *r, int level) {
+  int ret;
+
+  if ((r->z = calloc(1, sizeof(*r->z))) == NULL ||
+      (r->zin = malloc(r->size)) == NULL)
+    err(1, NULL);
+  r->zdeflate = level > 0;
+  ret = r->zdeflate ? deflateInit(r->z, level) : inflateInit(r->z);
+  if (ret != Z_OK)
+    errx(1, "zlib: %s", r->z->msg ? r->z->msg : zError(ret));
+}
+
+static void relay_free(struct relay *r) {
+  if (r->pipe[0] != -1)
+    close(r->pipe[0]);
+  if (r->pipe[1] != -1)
+    close(r->pipe[1]);
+  free(r->buf);
+  r->buf = NULL;
+  if (r->z != NULL) {
+    if (r->zdeflate)
+      (void)deflateEnd(r->z);
     else
-      return CONNECTION_FAILED;
+      (void)inflateEnd(r->z);
+    free(r->z);
+    free(r->zin);
+    r->z = NULL;
+    r->zin = NULL;
+  }
+#ifdef MSG_WAITFORONE
+  free(r->msgs);
+  free(r->iov);
+  free(r->cmsg);
+  r->msgs = NULL;
+  r->iov = NULL;
+  r->cmsg = NULL;
+#endif
+}
+
+/*
+ * relay_preload()
+ * Keep len bytes that were read from fd before the relay started, such
+ * as what the target sent right behind a proxy's reply, for relay_read()
+ * to return first.
+ */
+void relay_preload(int fd, const void *buf, size_t len) {
+  free(preload);
+  preload = NULL;
+  preload_fd = -1;
+  if ((preload_len = len) == 0)
+    return;
+  if ((preload = malloc(len)) == NULL)
+    err(1, NULL);
+  memcpy(preload, buf, len);
+  preload_fd = fd;
+}
+
+/*
+ * relay_read()
+ * read(2) for the relay, which hands out the preloaded bytes of fd
+ * before anything else.
+ */
+static ssize_t relay_read(int fd, void *buf, size_t len) {
+  if (fd != preload_fd)
+    return (read(fd, buf, len));
+  len = MIN(len, preload_len);
+  memcpy(buf, preload, len);
+  memmove(preload, preload + len, preload_len - len);
+  if ((preload_len -= len) == 0)
+    preload_fd = -1;
+  return (len);
+}
+
+/*
+ * stdin_early()
+ * Read what stdin already holds, up to len bytes, without waiting. -E
+ * sends it along with the proxy request.
+ */
+size_t stdin_early(unsigned char *buf, size_t len) {
+  struct pollfd pfd;
+  ssize_t n;
+
+  pfd.fd = STDIN_FILENO;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN))
+    return (0);
+  do
+    n = read(STDIN_FILENO, buf, len);
+  while (n == -1 && errno == EINTR);
+  if (n <= 0)
+    return (0);
+  if (vflag)
+    fprintf(stderr, "Sending %zd bytes with the proxy request\n", n);
+  return (n);
+}
+
+/* Bytes queued but not yet written. */
+static size_t relay_pending(struct relay *r) { return (r->len + r->piped); }
+
+/*
+ * relay_space()
+ * Return the largest contiguous free region of the ring buffer.
+ */
+static size_t relay_space(struct relay *r, unsigned char **p) {
+  size_t end;
+
+  if (r->len == 0)
+    r->off = 0;
+  end = r->off + r->len;
+  if (end < r->size) {
+    *p = r->buf + end;
+    return (r->size - end);
+  }
+  end -= r->size;
+  *p = r->buf + end;
+  return (r->off - end);
+}
+
+/*
+ * relay_minspace()
+ * Contiguous room needed before reading: a whole datagram for UDP, twice
+ * the bytes read for -C to insert its CRs, and room for the -H trailer
+ * in case the read finds EOF.
+ */
+static size_t relay_minspace(struct relay *r) {
+  if (uflag)
+    return (plen);
+  if (r->hash == HASH_SEND)
+    return (HASH_TRAILER);
+  return (r->crlf ? 2 : 1);
+}
+
+/*
+ * relay_pace()
+ * Limit what r writes to rate bytes, or writes if per_write is set, per
+ * second (-L). The bucket starts full.
+ */
+static void relay_pace(struct relay *r, double rate, int per_write) {
+  r->rate = rate;
+  r->per_write = per_write;
+  r->tokens = MAX(rate * PACE_BURST_MS / 1000, 1);
+  r->refill = monotime_ns();
+}
+
+/*
+ * relay_need()
+ * Tokens r must have before writing len bytes. The bucket holds
+ * PACE_BURST_MS worth of the rate, and at least one write. Waiting for
+ * a full bucket, or all of len, keeps slow rates from turning into a
+ * stream of tiny writes.
+ */
+static double relay_need(struct relay *r, size_t len) {
+  if (r->per_write || uflag)
+    return (1);
+  return (MIN(len, MAX(r->rate * PACE_BURST_MS / 1000, 1)));
+}
+
+/*
+ * relay_limit()
+ * How much of len bytes r may write now: all of them without -L, none
+ * while the token bucket is short. Datagrams and writes counted as a
+ * whole are never cut short; the bucket may go below zero instead.
+ */
+static size_t relay_limit(struct relay *r, size_t len) {
+  long long now;
+
+  if (r->rate == 0)
+    return (len);
+  now = monotime_ns();
+  r->tokens = MIN(MAX(r->rate * PACE_BURST_MS / 1000, 1),
+                  r->tokens + r->rate * (now - r->refill) / 1e9);
+  r->refill = now;
+  if (r->tokens < relay_need(r, len))
+    return (0);
+  if (r->per_write || uflag)
+    return (r->most > 0 ? MIN(len, r->most) : len);
+  return (MIN(len, (size_t)r->tokens));
+}
+
+/*
+ * relay_spend()
+ * Take a write of n bytes out of the -L token bucket of r.
+ */
+static void relay_spend(struct relay *r, size_t n) {
+  if (r->rate != 0)
+    r->tokens -= r->per_write ? 1 : n;
+}
+
+/*
+ * relay_want()
+ * How many bytes r has to write.
+ */
+static size_t relay_want(struct relay *r) {
+  if (r->mode == RELAY_SENDFILE)
+    return (r->eof ? 0 : SENDFILE_CHUNK);
+  return (relay_pending(r));
+}
+
+/*
+ * relay_pace_wait()
+ * Nanoseconds until r, if it has bytes to write, may write again under
+ * -L; -1 if it is not being held back.
+ */
+static long long relay_pace_wait(struct relay *r) {
+  double need;
+
+  if (r->rate == 0 || r->rfd == -1 || relay_want(r) == 0)
+    return (-1);
+  if ((need = relay_need(r, relay_want(r))) <= r->tokens)
+    return (-1);
+  return ((long long)((need - r->tokens) * 1e9 / r->rate) + 1);
+}
+
+/*
+ * relay_readfd()
+ * Return the descriptor the direction wants to read from, or -1 if it is
+ * finished reading or has no room to queue more.
+ */
+static int relay_readfd(struct relay *r) {
+  unsigned char *p;
+
+  if (r->rfd == -1)
+    return (-1);
+  /* Bytes left in the pipe after splice() was abandoned come first. */
+  if (r->mode == RELAY_COPY && r->piped > 0)
+    return (relay_space(r, &p) > 0 ? r->pipe[0] : -1);
+  if (r->eof || r->mode == RELAY_SENDFILE)
+    return (-1);
+  /* zlib takes a whole read before the next one. */
+  if (r->z != NULL && (r->z->avail_in > 0 || r->zeof))
+    return (-1);
+  /* Held back by -L, the direction already has bytes to write. */
+  if (relay_pace_wait(r) != -1)
+    return (-1);
+  if (r->mode == RELAY_DGRAM)
+    return (r->len == 0 ? r->rfd : -1);
+  if (r->mode == RELAY_SPLICE)
+    return (r->piped < r->pipesize ? r->rfd : -1);
+  return (relay_space(r, &p) >= relay_minspace(r) ? r->rfd : -1);
+}
+
+/*
+ * relay_writefd()
+ * Return the descriptor the direction wants to write to, or -1.
+ */
+static int relay_writefd(struct relay *r) {
+  int fd = -1;
+
+  if (r->rfd == -1)
+    return (-1);
+  if (r->mode == RELAY_SENDFILE)
+    fd = r->eof ? -1 : r->wfd;
+  else if (r->len > 0 || (r->mode == RELAY_SPLICE && r->piped > 0))
+    fd = r->wfd;
+  /* Held back by -L until the bucket has refilled. */
+  if (fd != -1 && relay_limit(r, relay_want(r)) == 0)
+    return (-1);
+  return (fd);
+}
+
+#ifdef MSG_WAITFORONE
+/*
+ * dgram_init()
+ * Lay out the RELAY_DGRAM slots of a direction that reads from or writes
+ * to the UDP socket sock. Sends turn on UDP_SEGMENT at plen here, so that
+ * no other path has to cope with it; receives leave room for whole
+ * UDP_GRO trains if the socket will coalesce.
+ */
+static void dgram_init(struct relay *r, int sock, int gro) {
+  unsigned int i;
+
+  r->sock = sock;
+  r->slot = plen;
+  if (r->rfd == sock && gro) {
+    r->gro = 1;
+    r->slot = UDP_GRO_SIZE;
+    r->size = MAX(r->size, UDP_GRO_SLOTS * r->slot);
+    if ((r->buf = realloc(r->buf, r->size)) == NULL)
+      err(1, NULL);
+  }
+#ifdef UDP_SEGMENT
+  /* Offload is best effort: older kernels simply send one at a time. */
+  if (r->wfd == sock &&
+      setsockopt(sock, IPPROTO_UDP, UDP_SEGMENT, &plen, sizeof(plen)) == 0)
+    r->gso = plen;
+#endif
+
+  r->nslots = MIN(r->size / r->slot, IOV_MAX);
+  r->msgs = calloc(r->nslots, sizeof(*r->msgs));
+  r->iov = calloc(r->nslots, sizeof(*r->iov));
+  if (r->msgs == NULL || r->iov == NULL)
+    err(1, NULL);
+  if (r->gro && (r->cmsg = calloc(r->nslots, CMSG_SPACE(sizeof(int)))) == NULL)
+    err(1, NULL);
+  for (i = 0; i < r->nslots; i++) {
+    r->msgs[i].msg_hdr.msg_iov = &r->iov[i];
+    r->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+/*
+ * dgram_split()
+ * Return the number of datagrams in the UDP_GRO train received in slot
+ * i. Datagrams over plen bytes are cut down in place to the plen bytes a
+ * plain read would have kept of each.
+ */
+static size_t dgram_split(struct relay *r, unsigned int i) {
+  struct msghdr *msg = &r->msgs[i].msg_hdr;
+  unsigned char *p = r->buf + (size_t)i * r->slot;
+  struct cmsghdr *cm;
+  size_t seg, len, off, out;
+  int gso = 0;
+
+  for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm))
+    if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+      memcpy(&gso, CMSG_DATA(cm), sizeof(gso));
+  len = r->msgs[i].msg_len;
+  seg = gso > 0 ? (size_t)gso : len;
+  if (len == 0)
+    return (1);
+  if (seg <= (size_t)plen)
+    return ((len + seg - 1) / seg);
+
+  for (off = out = 0; off < len; off += seg, out += plen)
+    memmove(p + out, p + off, MIN(len - off, (size_t)plen));
+  r->msgs[i].msg_len = out - plen + MIN(len - (off - seg), (size_t)plen);
+  return (out / plen);
+}
+
+/*
+ * dgram_fill()
+ * Fill the RELAY_DGRAM slots in one system call: a batch of datagrams
+ * from the socket with recvmmsg(), or stdin cut into datagrams of up to
+ * plen bytes with readv(). Returns -1 on error, 0 otherwise.
+ */
+static int dgram_fill(struct relay *r) {
+  unsigned int i;
+  ssize_t n;
+  size_t len;
+
+  for (i = 0; i < r->nslots; i++) {
+    r->iov[i].iov_base = r->buf + (size_t)i * r->slot;
+    r->iov[i].iov_len = r->slot;
+    if (r->gro) {
+      r->msgs[i].msg_hdr.msg_control = r->cmsg + i * CMSG_SPACE(sizeof(int));
+      r->msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+    }
+  }
+
+  if (r->rfd == r->sock) {
+    r->reads++;
+    if ((n = recvmmsg(r->rfd, r->msgs, r->nslots, MSG_DONTWAIT, NULL)) < 0)
+      return ((errno == EAGAIN || errno == EINTR) ? 0 : -1);
+    r->batches++;
+    for (len = 0, i = 0; i < (unsigned int)n; i++) {
+      r->dgrams += r->gro ? dgram_split(r, i) : 1;
+      len += r->msgs[i].msg_len;
+    }
+  } else {
+    r->reads++;
+    if ((n = readv(r->rfd, r->iov, r->nslots)) < 0)
+      return ((errno == EAGAIN || errno == EINTR) ? 0 : -1);
+    if (n == 0) {
+      r->eof = 1;
+      return (0);
+    }
+    for (len = n, i = 0; n > 0; i++, n -= plen)
+      r->msgs[i].msg_len = MIN(n, plen);
+    n = i;
+  }
+
+  r->head = 0;
+  r->count = n;
+  r->off = 0;
+  r->len = len;
+  return (0);
+}
+
+/*
+ * dgram_gso()
+ * Send the queued datagrams as UDP_SEGMENT trains. The slots filled from
+ * stdin are contiguous and all full but the last, so each train is one
+ * stretch of the buffer that the kernel cuts every plen bytes. Returns -1
+ * on error, 0 otherwise.
+ */
+static int dgram_gso(struct relay *r) {
+  struct mmsghdr msgs[UDP_GSO_SEGS];
+  struct iovec iov[UDP_GSO_SEGS];
+  unsigned char *p, *end;
+  size_t train;
+  int i, n;
+
+  train = MIN(UDP_GSO_SEGS, UDP_GSO_BYTES / plen) * (size_t)plen;
+  p = r->buf + (size_t)r->head * plen;
+  end = p + r->len;
+  memset(msgs, 0, sizeof(msgs));
+  for (n = 0; n < UDP_GSO_SEGS && p < end; n++, p += train) {
+    iov[n].iov_base = p;
+    iov[n].iov_len = MIN(train, (size_t)(end - p));
+    msgs[n].msg_hdr.msg_iov = &iov[n];
+    msgs[n].msg_hdr.msg_iovlen = 1;
+  }
+
+  r->writes++;
+  if ((n = sendmmsg(r->wfd, msgs, n, MSG_DONTWAIT)) < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return (0);
+    if (errno != EINVAL && errno != EIO)
+      return (-1);
+    /* No segmentation offload on this path, send one at a time. */
+    i = 0;
+    (void)setsockopt(r->wfd, IPPROTO_UDP, UDP_SEGMENT, &i, sizeof(i));
+    r->gso = 0;
+    return (0);
+  }
+  r->batches++;
+  for (i = 0; i < n; i++) {
+    r->dgrams += (iov[i].iov_len + plen - 1) / plen;
+    r->head += (iov[i].iov_len + plen - 1) / plen;
+    r->len -= iov[i].iov_len;
+    r->bytes += iov[i].iov_len;
+  }
+  return (0);
+}
+
+/*
+ * dgram_flush()
+ * Write out queued RELAY_DGRAM slots: as datagrams with sendmmsg() to the
+ * socket, or back to back with writev() to stdout. Returns -1 on error,
+ * 0 otherwise.
+ */
+static int dgram_flush(struct relay *r) {
+  unsigned int i;
+  ssize_t n;
+  size_t left;
+
+#ifdef UDP_SEGMENT
+  if (r->gso > 0 && r->wfd == r->sock)
+    return (dgram_gso(r));
+#endif
+
+  for (i = r->head; i < r->count; i++) {
+    r->iov[i].iov_base = r->buf + (size_t)i * r->slot;
+    r->iov[i].iov_len = r->msgs[i].msg_len;
+  }
+
+  if (r->wfd == r->sock) {
+    r->writes++;
+    n = sendmmsg(r->wfd, r->msgs + r->head, r->count - r->head, MSG_DONTWAIT);
+    if (n < 0)
+      return ((errno == EAGAIN || errno == EINTR) ? 0 : -1);
+    r->batches++;
+    r->dgrams += n;
+    for (i = 0; i < (unsigned int)n; i++) {
+      r->len -= r->msgs[r->head].msg_len;
+      r->bytes += r->msgs[r->head++].msg_len;
+    }
+    return (0);
+  }
+
+  r->iov[r->head].iov_base = (char *)r->iov[r->head].iov_base + r->off;
+  r->iov[r->head].iov_len -= r->off;
+  r->writes++;
+  if ((n = writev(r->wfd, r->iov + r->head, r->count - r->head)) < 0)
+    return ((errno == EAGAIN || errno == EINTR) ? 0 : -1);
+  r->len -= n;
+  r->bytes += n;
+  while (n > 0) {
+    left = r->msgs[r->head].msg_len - r->off;
+    if ((size_t)n < left) {
+      r->off += n;
+      break;
+    }
+    n -= left;
+    r->off = 0;
+    r->head++;
+  }
+  return (0);
+}
+
+/*
+ * dgram_report()
+ * Tell the user how well the socket side of a RELAY_DGRAM direction
+ * batched its datagrams.
+ */
+static void dgram_report(const char *what, struct relay *r) {
+  if (r->mode != RELAY_DGRAM)
+    return;
+  fprintf(stderr, "%s %lu datagrams in %lu batches (%.1f per call)\n", what,
+          r->dgrams, r->batches,
+          r->batches ? (double)r->dgrams / r->batches : 0.0);
+}
+#endif
+
+/*
+ * relay_summary()
+ * Print the -R totals of one direction. Small averages per system call
+ * point at undersized buffers; stalled time is spent waiting for the
+ * destination, idle time waiting for the source.
+ */
+static void relay_summary(const char *what, struct relay *r) {
+  double secs = (monotime_us() - r->start) / 1e6;
+
+  fprintf(stderr,
+          "%s: %llu bytes in %.2f s (%.2f MB/s), %lu reads (%.0f B/read), "
+          "%lu writes (%.0f B/write), %lu wakeups, %.2f s idle, "
+          "%.2f s stalled\n",
+          what, r->bytes, secs, secs > 0 ? r->bytes / secs / 1e6 : 0.0,
+          r->reads, r->reads ? (double)r->bytes / r->reads : 0.0, r->writes,
+          r->writes ? (double)r->bytes / r->writes : 0.0, r->wakeups,
+          r->idle / 1e6, r->stalled / 1e6);
+}
+
+/*
+ * relay_progress()
+ * Print the -R progress line: bytes so far and the rate since the last
+ * line, for each direction.
+ */
+static void relay_progress(struct relay *in, struct relay *out, double secs) {
+  fprintf(stderr, "recv %llu bytes %.2f MB/s, send %llu bytes %.2f MB/s\n",
+          in->bytes, (in->bytes - in->mark) / secs / 1e6, out->bytes,
+          (out->bytes - out->mark) / secs / 1e6);
+  in->mark = in->bytes;
+  out->mark = out->bytes;
+}
+
+/*
+ * relay_timer()
+ * Return how long readwrite() may wait for events in milliseconds: the -w
+ * timeout, counted from the last activity, cut short to print -R progress
+ * lines on time. -1 means forever.
+ */
+static int relay_timer(struct relay *in, struct relay *out, long long *tick,
+                       long long active) {
+  long long now, wait;
+
+  if (Rflag <= 0)
+    return (timeout);
+  now = monotime_ms();
+  if (now >= *tick + Rflag * 1000) {
+    relay_progress(in, out, (now - *tick) / 1000.0);
+    *tick = now;
+  }
+  wait = *tick + Rflag * 1000 - now;
+  if (timeout != -1)
+    wait = MIN(wait, MAX(active + timeout - now, 0));
+  return ((int)wait);
+}
+
+/*
+ * relay_expired()
+ * After a wait from relay_timer() ran out, tell whether the -w timeout
+ * has passed or it was only time for a progress line.
+ */
+static int relay_expired(long long active) {
+  return (Rflag <= 0 || (timeout != -1 && monotime_ms() - active >= timeout));
+}
+
+/*
+ * relay_tally()
+ * Charge a poll() of us microseconds to the direction polled with pfd[0]
+ * for reading and pfd[1] for writing.
+ */
+static void relay_tally(struct relay *r, struct pollfd *pfd, long long us) {
+  if (pfd[1].fd != -1)
+    r->stalled += us;
+  else if (pfd[0].fd != -1)
+    r->idle += us;
+  if (pfd[0].revents || pfd[1].revents)
+    r->wakeups++;
+}
+
+/*
+ * relay_report()
+ * Print the -R and -v summaries of the running readwrite(), at most once.
+ */
+static void relay_report(void) {
+  if (relay_in == NULL)
+    return;
+  if (vflag && relay_out->z != NULL)
+    fprintf(stderr,
+            "Compressed %lu bytes to %lu, received %lu bytes as %lu\n",
+            relay_out->z->total_in, relay_out->z->total_out,
+            relay_in->z->total_in, relay_in->z->total_out);
+  report_fastopen(relay_out->wfd);
+  if (relay_out->hash != 0 && relay_out->rfd != -1)
+    fprintf(stderr, "Sent %llu bytes, CRC32C %08x\n", relay_out->hashed,
+            relay_out->crc);
+  if (relay_in->hash == HASH_DONE &&
+      (relay_in->hashed > 0 || relay_in->verdict != 0)) {
+    fprintf(stderr, "Received %llu bytes, CRC32C %08x", relay_in->hashed,
+            relay_in->crc);
+    if (relay_in->verdict > 0)
+      fprintf(stderr, ", verified\n");
+    else if (relay_in->verdict == -1)
+      fprintf(stderr, ", MISMATCH: peer sent %llu bytes, CRC32C %08x\n",
+              relay_in->peer_len, relay_in->peer_crc);
+    else
+      fprintf(stderr, ", NOT VERIFIED: the stream ended before the "
+                      "checksum\n");
+  }
+  if (Rflag != -1) {
+    relay_summary("recv", relay_in);
+    relay_summary("send", relay_out);
+  }
+#ifdef MSG_WAITFORONE
+  if (vflag) {
+    dgram_report("Received", relay_in);
+    dgram_report("Sent", relay_out);
+  }
+#endif
+  relay_in = relay_out = NULL;
+}
+
+/*
+ * crc32c_sw()
+ * CRC32C one byte at a time from a table, for CPUs without the
+ * instruction.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t n) {
+  static uint32_t table[256];
+  uint32_t c;
+  int i, k;
+
+  if (table[1] == 0) {
+    for (i = 0; i < 256; i++) {
+      for (c = i, k = 0; k < 8; k++)
+        c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+      table[i] = c;
+    }
+  }
+  while (n-- > 0)
+    crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return (crc);
+}
+
+#ifdef HAVE_CRC32C_HW
+/*
+ * crc32c_hw()
+ * CRC32C eight bytes per instruction: SSE4.2 crc32 on x86-64, the ARMv8
+ * CRC32 extension on arm64.
+ */
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t n) {
+  uint64_t c = crc, v;
+
+  for (; n >= 8; n -= 8, p += 8) {
+    memcpy(&v, p, sizeof(v));
+#ifdef __x86_64__
+    c = _mm_crc32_u64(c, v);
+#else
+    c = __crc32cd((uint32_t)c, v);
+#endif
+  }
+  crc = (uint32_t)c;
+  for (; n > 0; n--, p++) {
+#ifdef __x86_64__
+    crc = _mm_crc32_u8(crc, *p);
+#else
+    crc = __crc32cb(crc, *p);
+#endif
+  }
+  return (crc);
+}
+#endif
+
+/*
+ * crc32c()
+ * Extend crc, the CRC32C (Castagnoli) of the bytes so far, over n more,
+ * in the manner of zlib's crc32(). Start with 0.
+ */
+static uint32_t crc32c(uint32_t crc, const unsigned char *p, size_t n) {
+#ifdef HAVE_CRC32C_HW
+  static int hw = -1;
+
+  if (hw == -1) {
+#ifdef __x86_64__
+    hw = __builtin_cpu_supports("sse4.2");
+#else
+    hw = 1;
+#endif
+  }
+  if (hw)
+    return (~crc32c_hw(~crc, p, n));
+#endif
+  return (~crc32c_sw(~crc, p, n));
+}
+
+/*
+ * relay_hash()
+ * Add the n bytes queued at position from onwards to the -H checksum of
+ * r, following them around the ring.
+ */
+static void relay_hash(struct relay *r, size_t from, size_t n) {
+  size_t at = (r->off + from) % r->size, len = MIN(n, r->size - at);
+
+  r->crc = crc32c(r->crc, r->buf + at, len);
+  r->crc = crc32c(r->crc, r->buf, n - len);
+  r->hashed += n;
+}
+
+/*
+ * relay_trailer()
+ * Put the -H trailer of r at p: the empty frame that ends the data, then
+ * the length and the CRC32C of everything r has sent.
+ */
+static void relay_trailer(struct relay *r, unsigned char *p) {
+  uint32_t t[HASH_TRAILER / 4];
+
+  t[0] = htonl(0);
+  t[1] = htonl((uint32_t)(r->hashed >> 32));
+  t[2] = htonl((uint32_t)r->hashed);
+  t[3] = htonl(r->crc);
+  memcpy(p, t, sizeof(t));
+}
+
+/*
+ * relay_frame()
+ * Put the header of a -H frame of n bytes at p.
+ */
+static void relay_frame(unsigned char *p, size_t n) {
+  uint32_t len = htonl((uint32_t)n);
+
+  memcpy(p, &len, sizeof(len));
+}
+
+/*
+ * relay_unframe()
+ * Cut the -H hello, frame headers and trailer out of the n bytes of the
+ * peer at p, moving the data down over them and hashing it. Returns the
+ * bytes of data left at p, or -1 if the peer is not speaking -H.
+ */
+static ssize_t relay_unframe(struct relay *r, unsigned char *p, size_t n) {
+  uint32_t t[HASH_TRAILER / 4], magic = htonl(HASH_MAGIC);
+  unsigned char *src = p, *end = p + n, *dst = p;
+  size_t len, want;
+
+  while (src < end) {
+    if (r->frame > 0) {
+      len = MIN(r->frame, (size_t)(end - src));
+      memmove(dst, src, len);
+      r->crc = crc32c(r->crc, dst, len);
+      r->hashed += len;
+      r->frame -= len;
+      src += len;
+      dst += len;
+      continue;
+    }
+    if (r->hash == HASH_DONE) {
+      warnx("the peer sent data after its -H trailer");
+      return (-1);
+    }
+    /* A header of 0 is the start of the trailer. */
+    want = HASH_HEADER;
+    if (r->hash == HASH_CHECK && r->got >= HASH_HEADER)
+      want = HASH_TRAILER;
+    len = MIN(want - r->got, (size_t)(end - src));
+    memcpy(r->hdr + r->got, src, len);
+    r->got += len;
+    src += len;
+    if (r->hash == HASH_HELLO && memcmp(r->hdr, &magic, r->got) != 0) {
+      warnx("the peer is not using -H");
+      r->verdict = -1;
+      return (-1);
+    }
+    if (r->got < want)
+      continue;
+    memcpy(t, r->hdr, r->got);
+    if (r->hash == HASH_HELLO) {
+      r->hash = HASH_CHECK;
+      r->got = 0;
+    } else if ((r->frame = ntohl(t[0])) > 0) {
+      r->got = 0;
+    } else if (want == HASH_TRAILER) {
+      r->peer_len = (unsigned long long)ntohl(t[1]) << 32 | ntohl(t[2]);
+      r->peer_crc = ntohl(t[3]);
+      r->verdict =
+          r->peer_len == r->hashed && r->peer_crc == r->crc ? 1 : -1;
+      r->hash = HASH_DONE;
+    }
+  }
+  return (dst - p);
+}
+
+/*
+ * relay_check()
+ * At EOF from the peer, note whether its -H trailer arrived. A peer that
+ * sent nothing at all, as with -d, has nothing to check either.
+ */
+static void relay_check(struct relay *r) {
+  if (r->hash == HASH_HELLO && r->got == 0)
+    r->verdict = 0;
+  else
+    r->verdict = -2;
+  r->hash = HASH_DONE;
+}
+
+/*
+ * relay_crlf()
+ * Copy the n bytes read at src down to dst, turning every LF into CRLF.
+ * With -CC an LF that already follows a CR is left alone. memchr() does
+ * the scanning, so long lines cost little more than a copy. dst may
+ * overlap src if it is at least n bytes lower. Returns the new length.
+ */
+static size_t relay_crlf(struct relay *r, unsigned char *dst,
+                         const unsigned char *src, size_t n) {
+  const unsigned char *end = src + n, *lf;
+  unsigned char *d = dst;
+  size_t len;
+  int cr;
+
+  for (; src < end; src = lf + 1) {
+    if ((lf = memchr(src, '\n', end - src)) == NULL)
+      lf = end;
+    len = lf - src;
+    cr = len > 0 ? src[len - 1] == '\r' : r->cr;
+    memmove(d, src, len);
+    d += len;
+    if (lf == end)
+      break;
+    if (r->crlf < 2 || !cr)
+      *d++ = '\r';
+    *d++ = '\n';
+    r->cr = 0;
+  }
+  if (n > 0)
+    r->cr = end[-1] == '\r';
+  return (d - dst);
+}
+
+/*
+ * relay_zpump()
+ * Run the zlib stream of r over what it has been given, into the free
+ * space of the ring buffer, until either runs out. Compressed input is
+ * only flushed through once it has waited ZLIB_FLUSH_MS, so the small
+ * reads of a busy stream share one flush but none is held back long.
+ * Returns -1 if the stream is corrupt, 0 otherwise.
+ */
+static int relay_zpump(struct relay *r) {
+  unsigned char *p;
+  size_t space;
+  ssize_t n;
+  int ret;
+
+  if (r->zdue != 0 && r->zflush == 0 && monotime_ns() >= r->zdue)
+    r->zflush = Z_SYNC_FLUSH;
+  while (!r->eof && (space = relay_space(r, &p)) > 0) {
+    r->z->next_out = p;
+    r->z->avail_out = space;
+    if (r->zdeflate)
+      ret = deflate(r->z, r->zflush);
+    else
+      ret = inflate(r->z, Z_NO_FLUSH);
+    n = space - r->z->avail_out;
+    if (r->hash != 0 && !r->zdeflate && (n = relay_unframe(r, p, n)) < 0)
+      return (-1);
+    r->len += n;
+    if (ret == Z_STREAM_END) {
+      r->eof = 1;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      warnx("zlib: %s", r->z->msg ? r->z->msg : zError(ret));
+      return (-1);
+    }
+    /* With room left over, z has taken all input and given all output. */
+    if (r->z->avail_out > 0) {
+      if (r->zflush == Z_SYNC_FLUSH) {
+        r->zflush = 0;
+        r->zdue = 0;
+      }
+      break;
+    }
+  }
+  return (0);
+}
+
+/*
+ * relay_zwait()
+ * Nanoseconds until the input r holds back for compression is due to be
+ * flushed; -1 if there is none.
+ */
+static long long relay_zwait(struct relay *r) {
+  if (r->z == NULL || r->zdue == 0 || r->zflush != 0)
+    return (-1);
+  return (MAX(r->zdue - monotime_ns(), 0));
+}
+
+/*
+ * relay_zfill()
+ * relay_fill() for a direction that compresses or decompresses: read
+ * once z has taken the last read, then queue its output.
+ */
+static int relay_zfill(struct relay *r) {
+  size_t head = r->hash == HASH_SEND ? HASH_HEADER : 0;
+  ssize_t n;
+
+  if (r->z->avail_in == 0 && !r->zeof) {
+    r->reads++;
+    if ((n = relay_read(r->rfd, r->zin + head, r->size - head)) < 0)
+      return ((errno == EAGAIN || errno == EINTR) ? 0 : -1);
+    if (n == 0) {
+      r->zeof = 1;
+      r->zflush = Z_FINISH;
+      /* The -H trailer goes last in the compressed stream. */
+      if (r->hash == HASH_SEND) {
+        relay_trailer(r, r->zin);
+        r->z->next_in = r->zin;
+        r->z->avail_in = HASH_TRAILER;
+      }
+    } else {
+      if (r->hash == HASH_SEND) {
+        r->crc = crc32c(r->crc, r->zin + head, n);
+        r->hashed += n;
+        relay_frame(r->zin, n);
+      }
+      r->z->next_in = r->zin;
+      r->z->avail_in = head + n;
+      if (r->zdeflate && r->zdue == 0)
+        r->zdue = monotime_ns() + ZLIB_FLUSH_MS * 1000000LL;
+    }
+  }
+  if (relay_zpump(r) < 0)
+    return (-1);
+  /* A peer without -Z input, as with -d, sends no stream at all. */
+  if (r->zeof && !r->eof && !r->zdeflate) {
+    if (r->z->total_in > 0)
+      warnx("compressed stream ended early");
+    r->eof = 1;
+  }
+  return (0);
+}
+
+/*
+ * relay_hello()
+ * Queue HASH_MAGIC ahead of anything r sends, so that the peer knows
+ * frames follow. With -Z it goes into the compressed stream, and z takes
+ * it at once so that reading is not held up behind it.
+ */
+static void relay_hello(struct relay *r) {
+  uint32_t magic = htonl(HASH_MAGIC);
+
+  if (r->z != NULL) {
+    memcpy(r->zin, &magic, sizeof(magic));
+    r->z->next_in = r->zin;
+    r->z->avail_in = sizeof(magic);
+    (void)relay_zpump(r);
+  } else {
+    memcpy(r->buf, &magic, sizeof(magic));
+    r->len = sizeof(magic);
+  }
+}
+
+/*
+ * relay_fill()
+ * Queue whatever can be read without blocking. Returns -1 on error, 0
+ * otherwise; r->eof is set once the source is exhausted.
+ */
+static int relay_fill(struct relay *r) {
+  unsigned char *p, *q, *head;
+  ssize_t n;
+  size_t space;
+  int from;
+
+#ifdef MSG_WAITFORONE
+  if (r->mode == RELAY_DGRAM)
+    return (dgram_fill(r));
+#endif
+#ifdef SPLICE_F_MOVE
+  if (r->mode == RELAY_SPLICE) {
+    r->reads++;
+    n = splice(r->rfd, NULL, r->pipe[1], NULL, r->pipesize - r->piped,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0)
+      r->piped += n;
+    else if (n == 0)
+      r->eof = 1;
+    else if (errno == EINVAL)
+      r->mode = RELAY_COPY;
+    else if (errno != EAGAIN && errno != EINTR)
+      return (-1);
+    if (r->mode == RELAY_SPLICE)
+      return (0);
+  }
+#endif
+
+  if (r->z != NULL)
+    return (relay_zfill(r));
+
+  from = r->piped > 0 ? r->pipe[0] : r->rfd;
+  space = relay_space(r, &p);
+  if (from == r->rfd && space < relay_minspace(r))
+    return (0);
+  if (uflag && space > (size_t)plen)
+    space = plen;
+  /* -H reads in behind the header of a frame, filled in once n is known. */
+  head = p;
+  if (r->hash == HASH_SEND) {
+    p += HASH_HEADER;
+    space -= HASH_HEADER;
+  }
+  /* -C reads into the upper half and expands downwards from p. */
+  q = p;
+  if (r->crlf) {
+    space /= 2;
+    q += space;
+  }
+
+  r->reads++;
+  if ((n = relay_read(from, q, space)) < 0)
+    return ((errno == EAGAIN || errno == EINTR) ? 0 : -1);
+  /* Bytes drained from the pipe of an abandoned splice() are queued too. */
+  if (from != r->rfd)
+    r->piped -= n;
+  else if (n == 0) {
+    r->eof = 1;
+    if (r->hash == HASH_SEND) {
+      relay_trailer(r, head);
+      r->len += HASH_TRAILER;
+    }
+    return (0);
+  }
+
+  if (r->telnet)
+    n = atelnet(r->rfd, &r->tn, p, n);
+  if (r->crlf)
+    n = relay_crlf(r, p, q, n);
+  if (r->hash == HASH_SEND) {
+    relay_frame(head, n);
+    relay_hash(r, r->len + HASH_HEADER, n);
+    r->len += HASH_HEADER;
+  } else if (r->hash != 0 && (n = relay_unframe(r, p, n)) < 0) {
+    return (-1);
+  }
+  r->len += n;
+  return (0);
+}
+
+/*
+ * relay_flush()
+ * Write out whatever the destination accepts without blocking. Returns -1
+ * on error, 0 otherwise.
+ */
+static int relay_flush(struct relay *r) {
+  struct iovec iov[2];
+  ssize_t n;
+  size_t len;
+
+#ifdef MSG_WAITFORONE
+  if (r->mode == RELAY_DGRAM)
+    return (dgram_flush(r));
+#endif
+#ifdef HAVE_SENDFILE
+  if (r->mode == RELAY_SENDFILE) {
+    if ((len = relay_limit(r, SENDFILE_CHUNK)) == 0)
+      return (0);
+    r->writes++;
+    n = sendfile_relay(r->rfd, r->wfd, len);
+    if (n > 0) {
+      r->bytes += n;
+      relay_spend(r, n);
+    } else if (n == 0)
+      r->eof = 1;
+    else if (n < 0 && (errno == EINVAL || errno == ENOSYS ||
+                       errno == ENOTSOCK || errno == EOPNOTSUPP))
+      r->mode = RELAY_COPY;
+    else if (n < 0 && errno != EAGAIN && errno != EINTR)
+      return (-1);
+    return (0);
+  }
+#endif
+#ifdef SPLICE_F_MOVE
+  if (r->mode == RELAY_SPLICE) {
+    if ((len = relay_limit(r, r->piped)) == 0)
+      return (0);
+    r->writes++;
+    n = splice(r->pipe[0], NULL, r->wfd, NULL, len,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      r->piped -= n;
+      r->bytes += n;
+      relay_spend(r, n);
+    }
+    else if (n < 0 && errno == EINVAL)
+      r->mode = RELAY_COPY; /* relay_fill() drains the pipe */
+    else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+      return (-1);
+    return (0);
+  }
+#endif
+
+  if (r->len == 0)
+    return (0);
+  len = MIN(r->len, r->size - r->off);
+  if (uflag && len > (size_t)plen)
+    len = plen;
+  /* Bytes that wrap around the ring go in the same call. */
+  iov[0].iov_base = r->buf + r->off;
+  iov[0].iov_len = len;
+  iov[1].iov_base = r->buf;
+  iov[1].iov_len = uflag ? 0 : r->len - len;
+  if ((len = relay_limit(r, len + iov[1].iov_len)) == 0)
+    return (0);
+  iov[0].iov_len = MIN(iov[0].iov_len, len);
+  iov[1].iov_len = len - iov[0].iov_len;
+  r->writes++;
+  if ((n = writev(r->wfd, iov, iov[1].iov_len > 0 ? 2 : 1)) < 0)
+    return ((errno == EAGAIN || errno == EINTR) ? 0 : -1);
+  r->off = (r->off + n) % r->size;
+  r->len -= n;
+  r->bytes += n;
+  relay_spend(r, n);
+  /* zlib may have more output waiting for the room. */
+  if (r->z != NULL)
+    return (relay_zpump(r));
+  return (0);
+}
+
+/*
+ * relay_cork()
+ * Set or clear TCP_CORK on the socket r writes to. Corked, the kernel
+ * only sends full segments; clearing it pushes out the partial tail.
+ */
+static void relay_cork(struct relay *r, int on) {
+#ifdef TCP_CORK
+  if (setsockopt(r->wfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0)
+    r->corked = on;
+#endif
+}
+
+/*
+ * readwrite()
+ * Relay between the network file descriptor and stdin/stdout. Every
+ * descriptor is non-blocking and each direction has its own buffer, so a
+ * slow reader on one side only holds back the direction feeding it.
+ */
+void readwrite(int nfd) {
+  struct relay in, out;
+  struct pollfd pfd[4];
+  int n, wfd = fileno(stdin);
+  int lfd = fileno(stdout);
+  int mode, shut = 0, gro = 0, wait;
+  long long t0 = 0, tick = 0, active = 0, pace, ns;
+  double rate = Lflag[0];
+  int writes = Lwrites[0];
+  size_t most = 0;
+#ifdef HAVE_SENDFILE
+  struct stat st;
+#endif
+
+  /* -i sends one write of up to plen bytes per interval. */
+  if (iflag && rate == 0) {
+    rate = 1.0 / iflag;
+    writes = 1;
+    most = plen;
+  }
+
+#ifdef HAVE_IO_URING
+  /* The ring relays plain byte streams; everything else polls. */
+  if (aflag && !uflag && !tflag && !Cflag && !Hflag && !Zflag && !so_cork &&
+      rate == 0 && Lflag[1] == 0 && preload_fd != nfd &&
+      uring_readwrite(nfd) == 0)
+    return;
+#endif
+
+  /*
+   * Telnet, CRLF, zlib and checksum processing need to see the bytes, and
+   * UDP must keep its datagram boundaries, so those directions always
+   * copy. So does a direction that starts with bytes a proxy read ahead.
+   * Plain UDP moves whole batches of datagrams per system call where it
+   * can, unless -L wants them one at a time.
+   */
+  mode = RELAY_COPY;
+#ifdef SPLICE_F_MOVE
+  if (!uflag && !tflag && !Hflag && !Zflag && preload_fd != nfd)
+    mode = RELAY_SPLICE;
+#endif
+#ifdef MSG_WAITFORONE
+  if (uflag && !tflag && Lflag[1] == 0)
+    mode = RELAY_DGRAM;
+#endif
+  relay_init(&in, nfd, lfd, mode);
+  in.telnet = tflag;
+  in.hash = Hflag ? HASH_HELLO : 0;
+  if (Zflag)
+    relay_zinit(&in, 0);
+  if (Lflag[1] != 0)
+    relay_pace(&in, Lflag[1], Lwrites[1]);
+
+  mode = RELAY_COPY;
+#ifdef SPLICE_F_MOVE
+  if (!uflag && !Cflag && !Hflag && !Zflag)
+    mode = RELAY_SPLICE;
+#endif
+#ifdef MSG_WAITFORONE
+  if (uflag && !Cflag && rate == 0)
+    mode = RELAY_DGRAM;
+#endif
+#ifdef HAVE_SENDFILE
+  /* A regular file on stdin goes to the socket with sendfile(). */
+  if (!uflag && !Cflag && !Hflag && !Zflag && fstat(wfd, &st) == 0 &&
+      S_ISREG(st.st_mode))
+    mode = RELAY_SENDFILE;
+#endif
+  relay_init(&out, wfd, nfd, mode);
+  out.crlf = Cflag;
+  out.hash = Hflag ? HASH_SEND : 0;
+  if (Zflag)
+    relay_zinit(&out, Zflag);
+  /* With -d nothing is sent, not even the -H hello. */
+  if (Hflag && !dflag)
+    relay_hello(&out);
+  out.cork = so_cork && !uflag;
+  if (rate != 0)
+    relay_pace(&out, rate, writes);
+  out.most = most;
+#ifdef SO_MAX_PACING_RATE
+  /* Have the kernel space out the packets of a -L send on the wire too. */
+  if (rate != 0 && !writes) {
+    unsigned int bps = MIN(rate, UINT_MAX - 1);
+
+    (void)setsockopt(nfd, SOL_SOCKET, SO_MAX_PACING_RATE, &bps, sizeof(bps));
+  }
+#endif
+#ifdef MSG_WAITFORONE
+#ifdef UDP_GRO
+  /* Only dgram_fill() can take apart the trains UDP_GRO delivers. */
+  gro = in.mode == RELAY_DGRAM;
+  if (uflag && setsockopt(nfd, IPPROTO_UDP, UDP_GRO, &gro, sizeof(gro)) < 0)
+    gro = 0;
+#endif
+  if (in.mode == RELAY_DGRAM)
+    dgram_init(&in, nfd, gro);
+  if (out.mode == RELAY_DGRAM)
+    dgram_init(&out, nfd, 0);
+#endif
+  relay_in = &in;
+  relay_out = &out;
+  if (dflag) {
+    out.rfd = -1;
+    fastopen_kick(nfd);
+  }
+
+  (void)set_nonblock(nfd);
+  if (stdout_flags == -1)
+    stdout_flags = set_nonblock(lfd);
+  if (!dflag && stdin_flags == -1)
+    stdin_flags = set_nonblock(wfd);
+  if (Rflag > 0)
+    tick = active = monotime_ms();
+
+  /*
+   * Run until the network side has closed and everything it sent has
+   * reached stdout. Bytes already taken from stdin are still delivered.
+   */
+  while (!in.eof || relay_pending(&in) > 0 || relay_pending(&out) > 0) {
+    /* Flush -Z input that has waited long enough. */
+    if (out.zdue != 0 && relay_zpump(&out) < 0)
+      break;
+    /* Queue what a proxy read past its reply, which poll() cannot see. */
+    if (preload_fd == in.rfd && relay_readfd(&in) != -1 &&
+        relay_fill(&in) < 0)
+      break;
+
+    pfd[0].fd = relay_readfd(&in);
+    pfd[1].fd = relay_writefd(&in);
+    pfd[2].fd = in.eof ? -1 : relay_readfd(&out);
+    pfd[3].fd = relay_writefd(&out);
+    pfd[0].events = pfd[2].events = POLLIN;
+    pfd[1].events = pfd[3].events = POLLOUT;
+
+    /* Wake for -R progress lines without resetting the -w idle clock. */
+    wait = relay_timer(&in, &out, &tick, active);
+    /* And when a direction held back by -L may write again. */
+    pace = relay_pace_wait(&in);
+    if ((ns = relay_pace_wait(&out)) != -1 && (pace == -1 || ns < pace))
+      pace = ns;
+    /* And when input held back by -Z is due to be flushed. */
+    if ((ns = relay_zwait(&out)) != -1 && (pace == -1 || ns < pace))
+      pace = ns;
+    ns = wait == -1 ? -1 : wait * 1000000LL;
+    if (pace != -1 && (ns == -1 || pace < ns))
+      ns = pace;
+    else
+      pace = -1;
+
+    if (Rflag != -1)
+      t0 = monotime_us();
+    /* Don't leave a corked tail behind while waiting for more input. */
+    n = 0;
+    if (out.corked && relay_pending(&out) == 0 && (n = poll(pfd, 4, 0)) == 0)
+      relay_cork(&out, 0);
+    if (n == 0)
+      n = poll_ns(pfd, 4, ns);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      close(nfd);
+      restore_stdio();
+      err(1, "Polling Error");
+    }
+    if (Rflag != -1) {
+      t0 = monotime_us() - t0;
+      relay_tally(&in, &pfd[0], t0);
+      relay_tally(&out, &pfd[2], t0);
+    }
+
+    if (n == 0) {
+      if (pace == -1 && relay_expired(active))
+        break;
+      continue;
+    }
+    if (Rflag > 0)
+      active = monotime_ms();
+
+    if (pfd[0].revents && relay_fill(&in) < 0)
+      break;
+    if (pfd[1].revents && relay_flush(&in) < 0)
+      break;
+    if (pfd[2].revents && relay_fill(&out) < 0)
+      break;
+    if (pfd[3].revents && out.cork && !out.corked)
+      relay_cork(&out, 1);
+    if (pfd[3].revents && relay_flush(&out) < 0)
+      break;
+
+    if (in.eof && (in.hash == HASH_HELLO || in.hash == HASH_CHECK))
+      relay_check(&in);
+
+    if (in.eof && relay_pending(&in) == 0 && in.rfd != -1) {
+      shutdown(nfd, SHUT_RD);
+      in.rfd = -1;
+    }
+
+    if (!shut && out.rfd != -1 && out.eof && relay_pending(&out) == 0) {
+      shut = 1;
+      fastopen_kick(nfd);
+      /* if user asked to die after a while, arrange for it */
+      if (qflag > 0) {
+        signal(SIGALRM, quit);
+        alarm(qflag);
+      } else {
+        shutdown(nfd, SHUT_WR);
+      }
+    }
+  }
+
+  relay_report();
+  relay_free(&in);
+  relay_free(&out);
+  restore_stdio();
+  if (in.verdict < 0)
+    exit(1);
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * A minimal io_uring, driven with the raw system calls so that no
+ * library is needed.
+ */
+struct uring {
+  int fd;
+  unsigned int *sqhead, *sqtail, *sqarray, sqmask;
+  unsigned int *cqhead, *cqtail, cqmask;
+  unsigned int tail;   /* Next free submission slot */
+  unsigned int queued; /* Slots filled since the last uring_enter() */
+  unsigned int entries;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *ring;
+  size_t ringsize, sqesize;
+};
+
+#define URING_ENTRIES 16
+
+/* user_data of relay operations: direction << 1 | write */
+#define URING_IN 0
+#define URING_OUT 2
+#define URING_WRITE 1
+/* user_data of connect attempts is the attempt; this marks their timers */
+#define URING_TIMER (~0ULL)
+
+/*
+ * uring_init()
+ * Set up a ring with room for entries submissions. Returns 0 on success,
+ * -1 if the kernel has no usable io_uring.
+ */
+static int uring_init(struct uring *u, unsigned int entries) {
+  struct io_uring_params p;
+  unsigned char *sq, *cq;
+
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+  if ((u->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return (-1);
+  /* Timed waits and reads at the file position need Linux 5.11. */
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_RW_CUR_POS)) {
+    close(u->fd);
+    return (-1);
   }
 
-  /* set connect timeout */
-  if (ctimeout > 0) {
-    tv.tv_sec = (time_t)ctimeout / 1000;
-    tv.tv_usec = 0;
-    tvp = &tv;
+  u->ringsize = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned int),
+                    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+  u->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->ring = mmap(NULL, u->ringsize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->sqes = mmap(NULL, u->sqesize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+    if (u->ring != MAP_FAILED)
+      munmap(u->ring, u->ringsize);
+    if (u->sqes != MAP_FAILED)
+      munmap(u->sqes, u->sqesize);
+    close(u->fd);
+    return (-1);
   }
 
-  /* attempt the connection */
-  err = connect(fd, sa, salen);
-
-  if (err != 0 && errno == EINPROGRESS) {
-    /* connection is proceeding
-     * it is complete (or failed) when select returns */
-
-    /* initialize connect_fdset */
-    FD_ZERO(&connect_fdset);
-    FD_SET(fd, &connect_fdset);
-
-    /* call select */
-    do {
-      err = select(fd + 1, NULL, &connect_fdset, NULL, tvp);
-    } while (err < 0 && errno == EINTR);
-
-    /* select error */
-    if (err < 0)
-      errx(1, "select error: %s", strerror(errno));
+  sq = cq = u->ring;
+  u->sqhead = (unsigned int *)(sq + p.sq_off.head);
+  u->sqtail = (unsigned int *)(sq + p.sq_off.tail);
+  u->sqarray = (unsigned int *)(sq + p.sq_off.array);
+  u->sqmask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+  u->cqhead = (unsigned int *)(cq + p.cq_off.head);
+  u->cqtail = (unsigned int *)(cq + p.cq_off.tail);
+  u->cqmask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  u->entries = p.sq_entries;
+  u->tail = *u->sqtail;
+  return (0);
+}
 
-    /* we have reached a timeout */
-    if (err == 0)
-      return CONNECTION_TIMEOUT;
+static void uring_free(struct uring *u) {
+  munmap(u->sqes, u->sqesize);
+  munmap(u->ring, u->ringsize);
+  close(u->fd);
+}
 
-    /* select returned successfully, but we must test socket
-     * error for result */
-    len = sizeof(err);
-    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
-      errx(1, "getsockopt error: %s", strerror(errno));
+/*
+ * uring_submit()
+ * Hand the queued operations to the kernel without waiting for any.
+ * Returns 0, or -1 with errno set.
+ */
+static int uring_submit(struct uring *u) {
+  int n;
 
-    /* setup errno according to the result returned by
-     * getsockopt */
-    if (err != 0)
-      errno = err;
-  }
+  __atomic_store_n(u->sqtail, u->tail, __ATOMIC_RELEASE);
+  n = (int)syscall(__NR_io_uring_enter, u->fd, u->queued, 0, 0, NULL, 0);
+  if (n < 0)
+    return (-1);
+  u->queued -= n;
+  return (0);
+}
 
-  /* return aborted if an error occured, and valid otherwise */
-  fcntl(fd, F_SETFL, orig_flags);
-  return (err != 0) ? CONNECTION_FAILED : CONNECTION_SUCCESS;
+/* Submission slots in use, queued or not yet taken by the kernel. */
+static unsigned int uring_used(struct uring *u) {
+  return (u->tail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE));
 }
 
 /*
- * local_listen()
- * Returns a socket listening on a local port, binds to specified source
- * address. Returns -1 on failure.
+ * uring_sqe()
+ * Return a cleared submission slot. A full ring is submitted first to
+ * make room; NULL if that does not free a slot.
  */
-int local_listen(char *host, char *port, struct addrinfo hints) {
-  struct addrinfo *res, *res0;
-  int s, ret, x = 1;
-  int error;
-
-  /* Allow nodename to be null. */
-  hints.ai_flags |= AI_PASSIVE;
-
-  /*
-   * In the case of binding to a wildcard address
-   * default to binding to an ipv4 address.
-   */
-  if (host == NULL && hints.ai_family == AF_UNSPEC)
-    hints.ai_family = AF_INET;
+static struct io_uring_sqe *uring_sqe(struct uring *u) {
+  struct io_uring_sqe *sqe;
+  unsigned int i;
+
+  if (uring_used(u) >= u->entries &&
+      (uring_submit(u) < 0 || uring_used(u) >= u->entries))
+    return (NULL);
+  i = u->tail++ & u->sqmask;
+  u->sqarray[i] = i;
+  u->queued++;
+  sqe = &u->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  return (sqe);
+}
 
-  if ((error = getaddrinfo(host, port, &hints, &res)))
-    errx(1, "getaddrinfo: %s", gai_strerror(error));
+/*
+ * uring_enter()
+ * Submit the queued operations and wait up to ms milliseconds (-1 for
+ * ever) for at least one completion. Returns 0, or -1 with errno set;
+ * ETIME means nothing completed in time.
+ */
+static int uring_enter(struct uring *u, int ms) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned int flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  int n;
+
+  memset(&arg, 0, sizeof(arg));
+  if (ms >= 0) {
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000LL;
+    arg.ts = (unsigned long long)(uintptr_t)&ts;
+  }
+  __atomic_store_n(u->sqtail, u->tail, __ATOMIC_RELEASE);
+  n = (int)syscall(__NR_io_uring_enter, u->fd, u->queued, 1, flags, &arg,
+                   sizeof(arg));
+  if (n < 0)
+    return (-1);
+  u->queued -= n;
+  return (0);
+}
 
-  res0 = res;
-  do {
-    if ((s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) < 0)
-      continue;
+/* The oldest unseen completion, or NULL. */
+static struct io_uring_cqe *uring_cqe(struct uring *u) {
+  unsigned int head = *u->cqhead;
 
-    ret = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &x, sizeof(x));
-    if (ret == -1)
-      err(1, NULL);
-#ifdef SO_REUSEPORT
-    ret = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &x, sizeof(x));
-    if (ret == -1)
-      err(1, NULL);
-#endif
-    set_common_sockopts(s);
+  if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE))
+    return (NULL);
+  return (&u->cqes[head & u->cqmask]);
+}
 
-    if (bind(s, (struct sockaddr *)res0->ai_addr, res0->ai_addrlen) == 0)
-      break;
+static void uring_seen(struct uring *u) {
+  __atomic_store_n(u->cqhead, *u->cqhead + 1, __ATOMIC_RELEASE);
+}
 
-    close(s);
-    s = -1;
-  } while ((res0 = res0->ai_next) != NULL);
+/*
+ * uring_relay()
+ * Queue the next operations of a RELAY_URING direction: a read into the
+ * free half of buf while the other half is written, and a write of the
+ * oldest half. Reads and writes each stay in order, one at a time.
+ */
+static void uring_relay(struct uring *u, struct relay *r, int dir) {
+  struct io_uring_sqe *sqe;
+  size_t size = r->size / 2;
+  int b;
+
+  /* Without a free slot, the operation waits for the next round. */
+  if (r->rfd != -1 && !r->reading && !r->eof && r->filled < 2 &&
+      (sqe = uring_sqe(u)) != NULL) {
+    b = (r->front + r->filled) % 2;
+    sqe->opcode = r->index != -1 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = r->rfd;
+    sqe->addr = (unsigned long long)(uintptr_t)(r->buf + b * size);
+    sqe->len = size;
+    sqe->off = (unsigned long long)-1;
+    sqe->buf_index = r->index != -1 ? r->index + b : 0;
+    sqe->user_data = dir;
+    r->reading = 1;
+    r->reads++;
+  }
 
-  if (!uflag && s != -1) {
-    if (listen(s, 1) < 0)
-      err(1, "listen");
+  if (!r->writing && r->filled > 0 && (sqe = uring_sqe(u)) != NULL) {
+    b = r->front;
+    sqe->opcode = r->index != -1 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = r->wfd;
+    sqe->addr = (unsigned long long)(uintptr_t)(r->buf + b * size + r->off);
+    sqe->len = r->half[b] - r->off;
+    sqe->off = (unsigned long long)-1;
+    sqe->buf_index = r->index != -1 ? r->index + b : 0;
+    sqe->user_data = dir | URING_WRITE;
+    r->writing = 1;
+    r->writes++;
   }
+}
 
-  if (vflag && s != -1) {
-    struct sockaddr_storage ss;
-    socklen_t len;
+/*
+ * uring_done()
+ * Account for a completed read or write of a RELAY_URING direction.
+ * Returns -1 on error, 0 otherwise.
+ */
+static int uring_done(struct relay *r, int write, int res) {
+  int b;
 
-    len = sizeof(ss);
-    if (getsockname(s, (struct sockaddr *)&ss, &len) == -1)
-      err(1, "getsockname");
-    report_sock(uflag ? "Bound" : "Listening", (struct sockaddr *)&ss, len,
-                NULL);
+  r->wakeups++;
+  if (res < 0 && res != -EAGAIN && res != -EINTR)
+    return (-1);
+  if (!write) {
+    r->reading = 0;
+    if (res == 0)
+      r->eof = 1;
+    if (res <= 0)
+      return (0);
+    b = (r->front + r->filled) % 2;
+    r->half[b] = res;
+    r->filled++;
+    r->len += res;
+    return (0);
   }
 
-  freeaddrinfo(res);
-
-  return (s);
+  r->writing = 0;
+  if (res <= 0)
+    return (0);
+  r->off += res;
+  r->len -= res;
+  r->bytes += res;
+  if (r->off == r->half[r->front]) {
+    r->off = 0;
+    r->front = (r->front + 1) % 2;
+    r->filled--;
+  }
+  return (0);
 }
 
 /*
- * readwrite()
- * Loop that polls on the network file descriptor and stdin.
+ * uring_readwrite()
+ * readwrite() on io_uring: each direction reads into one half of its
+ * buffer while the other half is being written, and every wait submits
+ * the follow-up operations of the previous round in the same system call.
+ * The buffers are registered with the ring when the kernel allows it.
+ * Returns -1 without touching any descriptor if no ring can be set up.
  */
-void readwrite(int nfd) {
-  struct pollfd pfd[2];
-  unsigned char buf[8192];
-  int n, wfd = fileno(stdin);
-  int lfd = fileno(stdout);
-  int plen;
+static int uring_readwrite(int nfd) {
+  struct uring u;
+  struct relay in, out;
+  struct io_uring_cqe *cqe;
+  struct iovec iov[4];
+  long long t0 = 0, tick = 0, active = 0;
+  int i, error = 0, shut = 0, wait, ret;
+
+  if (uring_init(&u, URING_ENTRIES) < 0)
+    return (-1);
 
-  plen = jflag ? 8192 : 1024;
+  relay_init(&in, nfd, fileno(stdout), RELAY_URING);
+  relay_init(&out, fileno(stdin), nfd, RELAY_URING);
+  for (i = 0; i < 2; i++) {
+    iov[i].iov_base = in.buf + i * (in.size / 2);
+    iov[i + 2].iov_base = out.buf + i * (out.size / 2);
+    iov[i].iov_len = iov[i + 2].iov_len = in.size / 2;
+  }
+  in.index = 0;
+  out.index = 2;
+  if (syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_BUFFERS, iov,
+              4) < 0)
+    in.index = out.index = -1;
+  relay_in = &in;
+  relay_out = &out;
+  if (dflag) {
+    out.rfd = -1;
+    fastopen_kick(nfd);
+  }
+  if (Rflag > 0)
+    tick = active = monotime_ms();
+
+  while (!in.eof || relay_pending(&in) > 0 || relay_pending(&out) > 0) {
+    uring_relay(&u, &in, URING_IN);
+    /* As with poll(), stdin is left alone once the network has closed. */
+    if (in.eof && out.rfd != -1 && !out.reading)
+      out.rfd = -1;
+    uring_relay(&u, &out, URING_OUT);
+
+    wait = relay_timer(&in, &out, &tick, active);
+    if (Rflag != -1)
+      t0 = monotime_us();
+    /* Keep the outcome: the timing below may change errno. */
+    ret = uring_enter(&u, wait) < 0 ? errno : 0;
+    if (ret != 0 && ret != EINTR && ret != ETIME) {
+      error = ret;
+      break;
+    }
+    if (Rflag != -1) {
+      t0 = monotime_us() - t0;
+      for (i = 0; i < 2; i++) {
+        struct relay *r = i ? &out : &in;
+
+        if (r->writing)
+          r->stalled += t0;
+        else if (r->reading)
+          r->idle += t0;
+      }
+    }
+
+    if ((cqe = uring_cqe(&u)) == NULL) {
+      if (ret == ETIME && relay_expired(active))
+        break;
+      continue;
+    }
+    for (; cqe != NULL; cqe = uring_cqe(&u)) {
+      i = (int)cqe->user_data;
+      if (uring_done(i & URING_OUT ? &out : &in, i & URING_WRITE,
+                     cqe->res) < 0)
+        error = -cqe->res;
+      uring_seen(&u);
+    }
+    if (error)
+      break;
+    if (Rflag > 0)
+      active = monotime_ms();
 
-  /* Setup Network FD */
-  pfd[0].fd = nfd;
-  pfd[0].events = POLLIN;
+    if (in.eof && relay_pending(&in) == 0 && in.rfd != -1) {
+      shutdown(nfd, SHUT_RD);
+      in.rfd = -1;
+    }
 
-  /* Set up STDIN FD. */
-  pfd[1].fd = wfd;
-  pfd[1].events = POLLIN;
+    if (!shut && out.rfd != -1 && out.eof && relay_pending(&out) == 0) {
+      shut = 1;
+      fastopen_kick(nfd);
+      /* if user asked to die after a while, arrange for it */
+      if (qflag > 0) {
+        signal(SIGALRM, quit);
+        alarm(qflag);
+      } else {
+        shutdown(nfd, SHUT_WR);
+      }
+    }
+  }
 
-  while (pfd[0].fd != -1) {
-    if (iflag)
-      sleep(iflag);
+  /* Closing the ring cancels what is still in flight. */
+  uring_free(&u);
+  relay_report();
+  relay_free(&in);
+  relay_free(&out);
+  return (0);
+}
 
-    if ((n = poll(pfd, 2 - dflag, timeout)) < 0) {
-      close(nfd);
-      err(1, "Polling Error");
+/*
+ * uring_race()
+ * The Happy Eyeballs race of remote_connect() on io_uring: each attempt
+ * is an asynchronous connect linked to a timeout of -w seconds, and the
+ * ring wait itself paces the start of the next attempt. Returns the
+ * connected socket, -1 if every attempt failed, or -2 if there is no
+ * usable io_uring.
+ */
+static int uring_race(struct addrinfo **ai, int n, const char *host,
+                      const char *port) {
+  struct uring u;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct __kernel_timespec ts;
+  const char *proto = proto_name(uflag);
+  long long now, nextstart = 0;
+  int *fds, i, s = -1, next = 0, active = 0;
+
+  if (uring_init(&u, URING_ENTRIES) < 0)
+    return (-2);
+  if ((fds = calloc(n, sizeof(*fds))) == NULL)
+    err(1, NULL);
+  ts.tv_sec = timeout / 1000;
+  ts.tv_nsec = (timeout % 1000) * 1000000LL;
+
+  while (s == -1 && (next < n || active > 0)) {
+    now = monotime_ms();
+
+    /* Start the next attempt if it is due, two entries per attempt. */
+    if (next < n && (active == 0 || now >= nextstart) &&
+        u.tail - *u.sqhead + 2 <= u.entries) {
+      i = next++;
+      if ((fds[i] = socket(ai[i]->ai_family, ai[i]->ai_socktype,
+                           ai[i]->ai_protocol)) < 0)
+        continue;
+      if (sflag || pflag)
+        source_bind(fds[i], ai[i]->ai_family);
+      set_common_sockopts(fds[i]);
+
+      sqe = uring_sqe(&u);
+      sqe->opcode = IORING_OP_CONNECT;
+      sqe->fd = fds[i];
+      sqe->addr = (unsigned long long)(uintptr_t)ai[i]->ai_addr;
+      sqe->off = ai[i]->ai_addrlen;
+      sqe->user_data = i;
+      if (timeout > 0) {
+        sqe->flags = IOSQE_IO_LINK;
+        sqe = uring_sqe(&u);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->addr = (unsigned long long)(uintptr_t)&ts;
+        sqe->len = 1;
+        sqe->user_data = URING_TIMER;
+      }
+      nextstart = now + CONNECT_ATTEMPT_DELAY;
+      active++;
+      continue;
     }
 
-    if (n == 0)
-      return;
+    if (uring_enter(&u, next < n ? (int)MAX(nextstart - now, 0) : -1) < 0 &&
+        errno != EINTR && errno != ETIME)
+      err(1, "io_uring_enter");
 
-    if (pfd[0].revents & POLLIN) {
-      if ((n = read(nfd, buf, plen)) < 0)
-        return;
-      else if (n == 0) {
-        goto shutdown_rd;
-      } else {
-        if (tflag)
-          atelnet(nfd, buf, n);
-        if (atomicio(vwrite, lfd, buf, n) != n)
-          return;
+    for (; (cqe = uring_cqe(&u)) != NULL; uring_seen(&u)) {
+      if (cqe->user_data == URING_TIMER)
+        continue;
+      i = (int)cqe->user_data;
+      if (cqe->res == 0 && s == -1) {
+        s = fds[i];
+        fds[i] = -1;
+        continue;
       }
-    } else if (pfd[0].revents & POLLHUP) {
-    shutdown_rd:
-      shutdown(nfd, SHUT_RD);
-      pfd[0].fd = -1;
-      pfd[0].events = 0;
-    }
-
-    if (!dflag) {
-      if (pfd[1].revents & POLLIN) {
-        if ((n = read(wfd, buf, plen)) < 0)
-          return;
-        else if (n == 0) {
-          goto shutdown_wr;
-        } else {
-          if ((Cflag) && (buf[n - 1] == '\n')) {
-            if (atomicio(vwrite, nfd, buf, n - 1) != (n - 1))
-              return;
-            if (atomicio(vwrite, nfd, "\r\n", 2) != 2)
-              return;
-          } else {
-            if (atomicio(vwrite, nfd, buf, n) != n)
-              return;
-          }
-        }
-      } else if (pfd[1].revents & POLLHUP) {
-      shutdown_wr:
-        /* if user asked to die after a while, arrange for it */
-        if (qflag > 0) {
-          signal(SIGALRM, quit);
-          alarm(qflag);
-        } else {
-          shutdown(nfd, SHUT_WR);
+      if (s == -1 && vflag) {
+        if (cqe->res == -ECANCELED)
+          warnx("connect to %s port %s (%s) timed out", host, port, proto);
+        else {
+          errno = -cqe->res;
+          warn("connect to %s port %s (%s) failed", host, port, proto);
         }
-        pfd[1].fd = -1;
-        pfd[1].events = 0;
       }
+      /* Don't wait out the attempt delay after a failure. */
+      if (fds[i] != -1)
+        close(fds[i]);
+      fds[i] = -1;
+      active--;
+      nextstart = monotime_ms();
     }
   }
+
+  /* Closing the ring cancels the attempts that lost the race. */
+  uring_free(&u);
+  for (i = 0; i < next; i++) {
+    if (fds[i] != -1)
+      close(fds[i]);
+  }
+  free(fds);
+  return (s);
 }
+#endif
 
-/* Deal with RFC 854 WILL/WONT DO/DONT negotiation. */
-void atelnet(int nfd, unsigned char *buf, unsigned int size) {
-  unsigned char *p, *end;
-  unsigned char obuf[4];
+#ifdef SPLICE_F_MOVE
+/*
+ * splice_pipe()
+ * Create the pipe used as a kernel buffer by RELAY_SPLICE and try to grow
+ * it to the relay buffer size. Returns 0 on success, -1 on failure.
+ */
+static int splice_pipe(int pp[2], size_t *size) {
+  int n = 65536; /* Linux default pipe capacity */
 
-  end = buf + size;
-  obuf[0] = '\0';
+  if (pipe(pp) < 0)
+    return (-1);
+  (void)fcntl(pp[0], F_SETFD, FD_CLOEXEC);
+  (void)fcntl(pp[1], F_SETFD, FD_CLOEXEC);
+  (void)fcntl(pp[0], F_SETFL, O_NONBLOCK);
+  (void)fcntl(pp[1], F_SETFL, O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+  if (fcntl(pp[1], F_SETPIPE_SZ, Bflag) < 0 ||
+      (n = fcntl(pp[1], F_GETPIPE_SZ)) < 0)
+    n = 65536;
+#endif
+  *size = n;
+  return (0);
+}
+#endif
 
-  for (p = buf; p < end; p++) {
-    if (*p != IAC)
-      break;
+#ifdef HAVE_SENDFILE
+/*
+ * sendfile_relay()
+ * Send up to len bytes of the regular file "from" to the socket "to",
+ * starting at the current file offset, which is advanced past the data
+ * sent. Returns the number of bytes sent, 0 on EOF or -1 on error.
+ */
+static ssize_t sendfile_relay(int from, int to, size_t len) {
+#ifdef __APPLE__
+  off_t off, sent;
+  int r;
+
+  if ((off = lseek(from, 0, SEEK_CUR)) < 0)
+    return (-1);
+  sent = len;
+  r = sendfile(from, to, off, &sent, NULL, 0);
+  if (sent > 0 && lseek(from, off + sent, SEEK_SET) < 0)
+    return (-1);
+  if (r < 0 && sent == 0)
+    return (-1);
+  return (sent);
+#else
+  return (sendfile(to, from, NULL, len));
+#endif
+}
+#endif
+
+/*
+ * atelnet()
+ * Deal with RFC 854 WILL/WONT DO/DONT negotiation on the size bytes read
+ * from nfd into buf: every option is refused, with all the replies to
+ * one read going out in one write. The commands are cut out of buf,
+ * moving the data down over them, and an escaped IAC is left as one
+ * 0xff byte. Returns the number of data bytes left in buf.
+ */
+size_t atelnet(int nfd, struct telnet *t, unsigned char *buf, size_t size) {
+  unsigned char reply[3 * TELNET_REPLIES];
+  unsigned char *p, *q, *end, *iac;
+  size_t nreply = 0;
 
-    obuf[0] = IAC;
-    p++;
-    if ((*p == WILL) || (*p == WONT))
-      obuf[1] = DONT;
-    if ((*p == DO) || (*p == DONT))
-      obuf[1] = WONT;
-    p++;
-    obuf[2] = *p;
-    obuf[3] = '\0';
-    if (atomicio(vwrite, nfd, obuf, 3) != 3)
-      warn("Write Error!");
-    obuf[0] = '\0';
+  end = buf + size;
+  for (p = q = buf; p < end;) {
+    switch (t->state) {
+    case TELNET_DATA:
+      /* Most reads hold no IAC at all; memchr() skips them quickly. */
+      if ((iac = memchr(p, IAC, end - p)) == NULL)
+        iac = end;
+      if (q != p)
+        memmove(q, p, iac - p);
+      q += iac - p;
+      p = iac;
+      if (p < end) {
+        t->state = TELNET_IAC;
+        p++;
+      }
+      break;
+    case TELNET_IAC:
+      if (*p == IAC) {
+        *q++ = IAC;
+        t->state = TELNET_DATA;
+      } else if (*p == WILL || *p == WONT || *p == DO || *p == DONT) {
+        t->verb = *p;
+        t->state = TELNET_OPT;
+      } else if (*p == SB)
+        t->state = TELNET_SB;
+      else
+        t->state = TELNET_DATA; /* A command without an option */
+      p++;
+      break;
+    case TELNET_OPT:
+      if (nreply == sizeof(reply)) {
+        if (atomicio(vwrite, nfd, reply, nreply) != nreply)
+          warn("Write Error!");
+        nreply = 0;
+      }
+      reply[nreply++] = IAC;
+      reply[nreply++] = (t->verb == WILL || t->verb == WONT) ? DONT : WONT;
+      reply[nreply++] = *p++;
+      t->state = TELNET_DATA;
+      break;
+    case TELNET_SB:
+      /* Subnegotiations are skipped up to the IAC SE that ends them. */
+      if ((iac = memchr(p, IAC, end - p)) == NULL)
+        p = end;
+      else {
+        p = iac + 1;
+        t->state = TELNET_SBIAC;
+      }
+      break;
+    case TELNET_SBIAC:
+      t->state = *p++ == SE ? TELNET_DATA : TELNET_SB;
+      break;
+    }
   }
+
+  if (nreply > 0 && atomicio(vwrite, nfd, reply, nreply) != nreply)
+    warn("Write Error!");
+  return (q - buf);
 }
 
 /*
@@ -890,6 +4280,230 @@ int udptest(int s) {
   return 1;
 }
 
+#ifdef IP_RECVERR
+/* Per-port state kept by udp_scan_ports(). */
+#define UDP_PORT_UNUSED 0
+#define UDP_PORT_PENDING 1 /* No answer yet: open|filtered */
+#define UDP_PORT_OPEN 2    /* Answered with data */
+#define UDP_PORT_CLOSED 3  /* Answered with an ICMP port unreachable */
+#define UDP_PORT_FILTERED 4 /* Another ICMP error, about the host or path */
+
+/*
+ * udp_scan_sock()
+ * Open an unconnected probe socket for family af that queues ICMP errors
+ * for every destination it sends to.
+ */
+static int udp_scan_sock(int af) {
+  int s, r, x = 1;
+
+  if ((s = socket(af, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    err(1, "socket");
+  (void)set_nonblock(s);
+  if (sflag || pflag)
+    source_bind(s, af);
+  set_common_sockopts(s);
+  if (af == AF_INET6)
+    r = setsockopt(s, IPPROTO_IPV6, IPV6_RECVERR, &x, sizeof(x));
+  else
+    r = setsockopt(s, IPPROTO_IP, IP_RECVERR, &x, sizeof(x));
+  if (r == -1)
+    err(1, "set IP_RECVERR");
+  return (s);
+}
+
+static int sockaddr_port(const struct sockaddr_storage *ss) {
+  if (ss->ss_family == AF_INET6)
+    return (ntohs(((const struct sockaddr_in6 *)ss)->sin6_port));
+  return (ntohs(((const struct sockaddr_in *)ss)->sin_port));
+}
+
+/*
+ * udp_scan_recv()
+ * Drain the ICMP errors and replies queued on s into state[], which is
+ * indexed by port number.
+ */
+static void udp_scan_recv(int s, const char *host, unsigned char *state) {
+  struct sockaddr_storage ss;
+  struct sock_extended_err *ee;
+  struct cmsghdr *cm;
+  struct msghdr msg;
+  struct iovec iov;
+  char buf[512], cbuf[512], port[PORT_MAX_LEN];
+  int p;
+
+  iov.iov_base = buf;
+  iov.iov_len = sizeof(buf);
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &ss;
+    msg.msg_namelen = sizeof(ss);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(s, &msg, MSG_ERRQUEUE) < 0)
+      break;
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+      ee = (struct sock_extended_err *)CMSG_DATA(cm);
+      if (ee->ee_origin != SO_EE_ORIGIN_ICMP &&
+          ee->ee_origin != SO_EE_ORIGIN_ICMP6)
+        continue;
+      /*
+       * msg_name holds the destination of the offending probe. Only a
+       * port unreachable error says the port is closed; host and network
+       * unreachable, prohibited and time exceeded say nothing about it.
+       */
+      p = sockaddr_port(&ss);
+      if (state[p] != UDP_PORT_PENDING)
+        continue;
+      state[p] = ee->ee_errno == ECONNREFUSED ? UDP_PORT_CLOSED
+                                              : UDP_PORT_FILTERED;
+      if (vflag) {
+        snprintf(port, sizeof(port), "%d", p);
+        warnx("connect to %s port %s (udp) %s: %s", host, port,
+              state[p] == UDP_PORT_CLOSED ? "failed" : "filtered",
+              strerror(ee->ee_errno));
+      }
+    }
+  }
+
+  for (;;) {
+    socklen_t len = sizeof(ss);
+
+    if (recvfrom(s, buf, sizeof(buf), 0, (struct sockaddr *)&ss, &len) < 0) {
+      /* An error is pending in the queue; pick it up next time. */
+      break;
+    }
+    p = sockaddr_port(&ss);
+    if (state[p] != UDP_PORT_PENDING)
+      continue;
+    state[p] = UDP_PORT_OPEN;
+    snprintf(port, sizeof(port), "%d", p);
+    report_connect(host, port);
+  }
+}
+
+/*
+ * udp_scan_wait()
+ * Process replies on the probe sockets until the time "until".
+ */
+static void udp_scan_wait(struct pollfd *pfd, int npfd, long long until,
+                          const char *host, unsigned char *state) {
+  long long now;
+  int i;
+
+  do {
+    now = monotime_ms();
+    if (poll(pfd, npfd, (int)MAX(until - now, 0)) < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "poll");
+    }
+    for (i = 0; i < npfd; i++) {
+      if (pfd[i].revents)
+        udp_scan_recv(pfd[i].fd, host, state);
+    }
+  } while (monotime_ms() < until);
+}
+
+/*
+ * udp_scan_ports()
+ * UDP scan of every port in portlist[]. Probes go out from one socket per
+ * address family in bursts of -m, and ICMP port unreachable errors are
+ * collected from the socket error queues. Since ICMP errors are rate
+ * limited, unanswered ports are probed UDP_SCAN_TRIES times; those still
+ * silent after the last -w wait are reported as open|filtered. Other ICMP
+ * errors leave a port filtered, which -v reports. Returns 0 if any port
+ * may be open, 1 otherwise.
+ */
+int udp_scan_ports(const char *host, struct addrinfo hints) {
+  struct sockaddr_storage *dst;
+  struct pollfd pfd[2];
+  struct addrinfo *res;
+  unsigned char *state;
+  long long wait;
+  socklen_t len;
+  int *dstfd, fd4 = -1, fd6 = -1;
+  int i, n, npfd, nports, try, error, ret = 1;
+
+  for (nports = 0; portlist[nports] != NULL; nports++)
+    ;
+  if ((state = calloc(PORT_MAX + 1, 1)) == NULL ||
+      (dst = calloc(nports, sizeof(*dst))) == NULL ||
+      (dstfd = calloc(nports, sizeof(*dstfd))) == NULL)
+    err(1, NULL);
+
+  for (i = 0; i < nports; i++) {
+    if ((error = resolve(host, portlist[i], &hints, &res)))
+      errx(1, "getaddrinfo: %s", gai_strerror(error));
+    memcpy(&dst[i], res->ai_addr, res->ai_addrlen);
+    if (res->ai_family == AF_INET6) {
+      if (fd6 == -1)
+        fd6 = udp_scan_sock(AF_INET6);
+      dstfd[i] = fd6;
+    } else {
+      if (fd4 == -1)
+        fd4 = udp_scan_sock(AF_INET);
+      dstfd[i] = fd4;
+    }
+    state[atoi(portlist[i])] = UDP_PORT_PENDING;
+    resolve_free(res);
+  }
+
+  npfd = 0;
+  if (fd4 != -1)
+    pfd[npfd++].fd = fd4;
+  if (fd6 != -1)
+    pfd[npfd++].fd = fd6;
+  pfd[0].events = pfd[1].events = POLLIN;
+
+  wait = (timeout > 0 ? timeout : UDP_SCAN_TIMEOUT * 1000) / UDP_SCAN_TRIES;
+  for (try = 0; try < UDP_SCAN_TRIES; try++) {
+    for (i = 0, n = 0; i < nports; i++) {
+      if (state[atoi(portlist[i])] != UDP_PORT_PENDING)
+        continue;
+      len = dst[i].ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                         : sizeof(struct sockaddr_in);
+      /*
+       * A failed send may only be reporting the ICMP error of an earlier
+       * probe, which stays in the error queue; the retry is the real one.
+       */
+      if (sendto(dstfd[i], "X", 1, 0, (struct sockaddr *)&dst[i], len) < 0 &&
+          sendto(dstfd[i], "X", 1, 0, (struct sockaddr *)&dst[i], len) < 0 &&
+          errno != EAGAIN && errno != ENOBUFS)
+        err(1, "sendto");
+      /* Pace bursts of -m probes; ICMP errors are rate limited. */
+      if (++n % mflag == 0)
+        udp_scan_wait(pfd, npfd, monotime_ms() + UDP_SCAN_GAP, host, state);
+    }
+    udp_scan_wait(pfd, npfd, monotime_ms() + wait, host, state);
+  }
+
+  for (i = 0; i < nports; i++) {
+    switch (state[atoi(portlist[i])]) {
+    case UDP_PORT_PENDING:
+      report_connect(host, portlist[i]);
+      /* FALLTHROUGH */
+    case UDP_PORT_OPEN:
+      ret = 0;
+      break;
+    }
+  }
+
+  if (fd4 != -1)
+    close(fd4);
+  if (fd6 != -1)
+    close(fd6);
+  free(state);
+  free(dst);
+  free(dstfd);
+  return (ret);
+}
+#endif
+
 void set_common_sockopts(int s) {
   int x = 1;
 
@@ -913,6 +4527,83 @@ void set_common_sockopts(int s) {
     if (setsockopt(s, IPPROTO_IP, IP_TOS, &Tflag, sizeof(Tflag)) == -1)
       err(1, "set IP ToS");
   }
+  /* Set before connect() or listen(), so the window scale fits them. */
+  if (Iflag)
+    set_bufsize(s, SO_RCVBUF, Iflag);
+  if (Oflag)
+    set_bufsize(s, SO_SNDBUF, Oflag);
+#ifdef TCP_CONGESTION
+  if (so_congestion != NULL && !uflag) {
+    if (setsockopt(s, IPPROTO_TCP, TCP_CONGESTION, so_congestion,
+                   strlen(so_congestion)) == -1)
+      err(1, "set congestion control %s", so_congestion);
+  }
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+  if (so_lowat != -1 && !uflag) {
+    if (setsockopt(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &so_lowat,
+                   sizeof(so_lowat)) == -1)
+      err(1, "set unsent low water mark");
+  }
+#endif
+  if (so_keepalive && !uflag) {
+    if (setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &x, sizeof(x)) == -1)
+      err(1, "set keepalive");
+#ifdef TCP_KEEPIDLE
+    if ((so_keepidle && setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE, &so_keepidle,
+                                   sizeof(so_keepidle)) == -1) ||
+        (so_keepintvl &&
+         setsockopt(s, IPPROTO_TCP, TCP_KEEPINTVL, &so_keepintvl,
+                    sizeof(so_keepintvl)) == -1) ||
+        (so_keepcnt && setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT, &so_keepcnt,
+                                  sizeof(so_keepcnt)) == -1))
+      err(1, "set keepalive timers");
+#endif
+  }
+#ifdef UDP_GRO
+  if (uflag)
+    (void)setsockopt(s, IPPROTO_UDP, UDP_GRO, &x, sizeof(x));
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+  /*
+   * connect() then returns at once when a cookie for the server is
+   * cached, and the SYN leaves with the first write. Scans need to see
+   * the real handshake.
+   */
+  if (Fflag && !lflag && !zflag) {
+    if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &x, sizeof(x)) == -1)
+      err(1, "set TCP Fast Open");
+  }
+#endif
+}
+
+/*
+ * set_bufsize()
+ * Set SO_RCVBUF or SO_SNDBUF of s to size. The FORCE variants go past
+ * the system maximum when we are privileged; otherwise the kernel may
+ * cap the size, which -v reports once.
+ */
+static void set_bufsize(int s, int opt, int size) {
+  static int warned;
+  const char *what = opt == SO_RCVBUF ? "receive" : "send";
+  int bit = opt == SO_RCVBUF ? 1 : 2, got;
+  socklen_t len;
+
+#ifdef SO_RCVBUFFORCE
+  if (setsockopt(s, SOL_SOCKET,
+                 opt == SO_RCVBUF ? SO_RCVBUFFORCE : SO_SNDBUFFORCE, &size,
+                 sizeof(size)) == 0)
+    return;
+#endif
+  if (setsockopt(s, SOL_SOCKET, opt, &size, sizeof(size)) == -1)
+    err(1, "set %s buffer size", what);
+
+  len = sizeof(got);
+  if (vflag && !(warned & bit) &&
+      getsockopt(s, SOL_SOCKET, opt, &got, &len) == 0 && got < size) {
+    warnx("%s buffer limited to %d bytes", what, got);
+    warned |= bit;
+  }
 }
 
 int parse_iptos(char *s) {
@@ -930,6 +4621,89 @@ int parse_iptos(char *s) {
   return (tos);
 }
 
+/*
+ * parse_rate()
+ * Take one -L rate: bytes per second, with an optional k, m or g suffix
+ * for powers of 1024, or writes (datagrams with -u) per second when it
+ * ends in p.
+ */
+void parse_rate(char *s, double *rate, int *writes) {
+  char *endp;
+
+  *rate = strtod(s, &endp);
+  switch (*endp) {
+  case 'g':
+  case 'G':
+    *rate *= 1024;
+    /* FALLTHROUGH */
+  case 'm':
+  case 'M':
+    *rate *= 1024;
+    /* FALLTHROUGH */
+  case 'k':
+  case 'K':
+    *rate *= 1024;
+    endp++;
+  }
+  *writes = *endp == 'p';
+  if (*writes)
+    endp++;
+  if (endp == s || *endp != '\0' || !(*rate > 0) || *rate > 1e15)
+    errx(1, "rate not valid: %s", s);
+}
+
+/*
+ * parse_sockopts()
+ * Take a comma separated list of -o socket options:
+ *   cc=name         TCP congestion control algorithm
+ *   lowat=bytes     TCP_NOTSENT_LOWAT
+ *   cork            TCP_CORK while sending in bulk
+ *   keepalive[=idle[:interval[:count]]]
+ */
+void parse_sockopts(char *list) {
+  char *opt, *val, *endp;
+  int *timer[3] = {&so_keepidle, &so_keepintvl, &so_keepcnt};
+  int i;
+
+  while ((opt = strsep(&list, ",")) != NULL) {
+    val = opt;
+    (void)strsep(&val, "=");
+    if (strcmp(opt, "cc") == 0 && val != NULL && *val != '\0') {
+#ifndef TCP_CONGESTION
+      errx(1, "congestion control cannot be chosen on this system");
+#endif
+      so_congestion = val;
+    } else if (strcmp(opt, "lowat") == 0 && val != NULL) {
+#ifndef TCP_NOTSENT_LOWAT
+      errx(1, "lowat is not supported on this system");
+#endif
+      so_lowat = (int)strtoul(val, &endp, 10);
+      if (so_lowat < 0 || *val == '\0' || *endp != '\0')
+        errx(1, "unsent low water mark not valid");
+    } else if (strcmp(opt, "cork") == 0 && val == NULL) {
+#ifndef TCP_CORK
+      errx(1, "cork is not supported on this system");
+#endif
+      so_cork = 1;
+    } else if (strcmp(opt, "keepalive") == 0) {
+      so_keepalive = 1;
+      for (i = 0; val != NULL && i < 3; i++) {
+        *timer[i] = (int)strtoul(val, &endp, 10);
+        if (*timer[i] < 0 || (*endp != '\0' && *endp != ':'))
+          errx(1, "keepalive timers not valid");
+        val = *endp == ':' ? endp + 1 : NULL;
+      }
+      if (val != NULL)
+        errx(1, "keepalive timers not valid");
+#ifndef TCP_KEEPIDLE
+      if (so_keepidle || so_keepintvl || so_keepcnt)
+        errx(1, "keepalive timers cannot be set on this system");
+#endif
+    } else
+      errx(1, "unknown socket option %s", opt);
+  }
+}
+
 void report_sock(const char *msg, const struct sockaddr *sa, socklen_t salen,
                  char *path) {
   char host[NI_MAXHOST], port[NI_MAXSERV];
@@ -963,23 +4737,36 @@ void help(void) {
   fprintf(stderr, "\tCommand Summary:\n\
 	\t-4		Use IPv4\n\
 	\t-6		Use IPv6\n\
+	\t-a		Use io_uring where the kernel offers it\n\
+	\t-B bufsize\tRelay buffer size for each direction\n\
+	\t-b backlog\tListen queue length\n\
 	\t-D		Enable the debug socket option\n\
 	\t-d		Detach from stdin\n\
+	\t-E		Pipeline the proxy handshake, with waiting stdin\n\
+	\t-F		Use TCP Fast Open\n\
+	\t-H		Checksum each direction, verify the peer's (CRC32C)\n\
 	\t-h		This help text\n\
+	\t-I length\tSocket receive buffer size\n\
 	\t-i secs\t	Delay interval for lines sent, ports scanned\n\
 	\t-k		Keep inbound sockets open for multiple connects\n\
+	\t-L rate\t	Send[,receive] rate limit in bytes, or writes with p\n\
 	\t-l		Listen mode, for inbound connects\n\
+	\t-m count\tConnections at once when scanning or with -k\n\
 	\t-n		Suppress name/port resolutions\n\
+	\t-O length\tSocket send buffer size\n\
+	\t-o option\tSocket options: cc=name, lowat=bytes, cork,\n\
+	\t\t\tkeepalive[=idle[:interval[:count]]]\n\
 	\t-P proxyuser\tUsername for proxy authentication\n\
 	\t-p port\t	Specify local port for remote connects\n\
 	\t-q secs\t	quit after EOF on stdin and delay of secs\n\
+	\t-R secs\t	Transfer statistics, progress every secs (0: none)\n\
 	\t-r		Randomize remote ports\n "
 #ifdef TCP_MD5SIG
                   "	\t-S		Enable the TCP MD5 signature option\n"
 #endif
                   "	\t-s addr\t	Local source address\n\
 	\t-T ToS\t	Set IP Type of Service\n\
-	\t-C		Send CRLF as line-ending\n\
+	\t-C		Send CRLF as line-ending, -CC keeps existing CRLFs\n\
 	\t-t		Answer TELNET negotiation\n\
 	\t-U		Use UNIX domain socket\n\
 	\t-u		UDP mode\n\
@@ -987,6 +4774,8 @@ void help(void) {
 	\t-w secs\t	Timeout for connects and final net reads\n\
 	\t-X proto	Proxy protocol: \"4\", \"5\" (SOCKS) or \"connect\"\n\
 	\t-x addr[:port]\tSpecify proxy address and port\n\
+	\t-Y count\tStripe stdin over count connections, in order\n\
+	\t-Z level\tCompress what is sent at level 1-9, inflate replies\n\
 	\t-z		Zero-I/O mode [used for scanning]\n\
 	Port numbers can be individual or ranges: lo-hi [inclusive]\n");
   exit(0);
@@ -996,12 +4785,17 @@ void usage(int ret) {
   fprintf(stderr, "This is nc from the netcat-openbsd package. An alternative "
                   "nc is available\n");
   fprintf(stderr, "in the netcat-traditional package.\n");
-  fprintf(stderr, "usage: nc [-46DdhklnrStUuvzC] [-i interval] [-P "
-                  "proxy_username] [-p source_port]\n");
-  fprintf(
-      stderr,
-      "\t  [-s source_ip_address] [-T ToS] [-w timeout] [-X proxy_protocol]\n");
-  fprintf(stderr, "\t  [-x proxy_address[:port]] [hostname] [port[s]]\n");
+  fprintf(stderr, "usage: nc [-46aDdEFHhklnrStUuvzC] [-B bufsize] "
+                  "[-b backlog] [-I length]\n");
+  fprintf(stderr, "\t  [-i interval] [-L rate[,rate]] [-m count] "
+                  "[-O length]\n");
+  fprintf(stderr, "\t  [-o option[,option...]] [-P proxy_username] "
+                  "[-p source_port]\n");
+  fprintf(stderr, "\t  [-R interval] [-s source_ip_address] [-T ToS] "
+                  "[-w timeout]\n");
+  fprintf(stderr, "\t  [-X proxy_protocol] [-x proxy_address[:port]] "
+                  "[-Y count] [-Z level]\n");
+  fprintf(stderr, "\t  [hostname] [port[s]]\n");
   if (ret)
     exit(1);
 }
@@ -1012,5 +4806,7 @@ void usage(int ret) {
  */
 static void quit() {
   /* XXX: should explicitly close fds here */
+  relay_report();
+  restore_stdio();
   exit(0);
 }
@@ -27,12 +27,14 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <err.h>
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -52,13 +54,34 @@
 #define SOCKS_IPV4	1
 #define SOCKS_DOMAIN	3
 #define SOCKS_IPV6	4
+#define PROXY_BUF_SIZE	4096
+#define PROXY_LINE_SIZE	1024
+#define PROXY_REQ_SIZE	(2 * PROXY_LINE_SIZE + 2)
+
+/*
+ * Replies of the proxy are read through a buffer, a chunk per read(2).
+ * Whatever follows them is the start of the relayed data.
+ */
+struct proxy_reader {
+	int		fd;
+	size_t		off;	/* Start of the unread bytes in buf */
+	size_t		len;	/* Unread bytes in buf */
+	unsigned char	buf[PROXY_BUF_SIZE];
+};
 
 extern int b64_ntop(unsigned char const *, size_t, char *, size_t);
 
 int	remote_connect(const char *, const char *, struct addrinfo);
+void	relay_preload(int, const void *, size_t);
 int	socks_connect(const char *, const char *, struct addrinfo,
 	    const char *, const char *, struct addrinfo, int,
+	    const char *, int, const void *, size_t);
+void	socks_password(const char *, const char *);
+const char *socks_port(int);
+struct socks_hs *socks_start(int, const char *, const char *, int,
 	    const char *);
+int	socks_step(struct socks_hs *, short *, const char **);
+void	socks_free(struct socks_hs *);
 
 static int
 decode_addrport(const char *h, const char *p, struct sockaddr *addr,
@@ -89,28 +112,103 @@ decode_addrport(const char *h, const char *p, struct sockaddr *addr,
 	return (0);
 }
 
+/*
+ * Send the pieces of a request with one writev(2), so that they leave
+ * in one segment rather than one round of Nagle's algorithm each.
+ */
+static void
+proxy_write(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err(1, "write failed");
+		}
+		for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/*
+ * Read what the proxy has sent so far into the free end of the buffer.
+ * Returns what read(2) did, with errno EPIPE at EOF like atomicio().
+ */
+static ssize_t
+proxy_fill(struct proxy_reader *pr)
+{
+	ssize_t n;
+
+	if (pr->off > 0) {
+		memmove(pr->buf, pr->buf + pr->off, pr->len);
+		pr->off = 0;
+	}
+	do {
+		n = read(pr->fd, pr->buf + pr->len, sizeof(pr->buf) - pr->len);
+	} while (n == -1 && (errno == EINTR || errno == EAGAIN));
+	if (n == 0)
+		errno = EPIPE;
+	else if (n > 0)
+		pr->len += n;
+	return (n);
+}
+
+/*
+ * Take the next len bytes of the reply. Returns fewer only if the proxy
+ * closed the connection first.
+ */
+static size_t
+proxy_read(struct proxy_reader *pr, unsigned char *buf, size_t len)
+{
+	while (pr->len < len && proxy_fill(pr) > 0)
+		;
+	if (len > pr->len)
+		len = pr->len;
+	memcpy(buf, pr->buf + pr->off, len);
+	pr->off += len;
+	pr->len -= len;
+	return (len);
+}
+
+/*
+ * Take the next line of the reply, without CRs and the LF, as a string.
+ */
 static int
-proxy_read_line(int fd, char *buf, size_t bufsz)
+proxy_read_line(struct proxy_reader *pr, char *buf, size_t bufsz)
 {
+	unsigned char *p, *nl;
 	size_t off;
 
-	for(off = 0;;) {
-		if (off >= bufsz)
+	while ((nl = memchr(pr->buf + pr->off, '\n', pr->len)) == NULL) {
+		if (pr->len >= bufsz || pr->len == sizeof(pr->buf))
 			errx(1, "proxy read too long");
-		if (atomicio(read, fd, buf + off, 1) != 1)
+		if (proxy_fill(pr) <= 0)
 			err(1, "proxy read");
+	}
+	for (off = 0, p = pr->buf + pr->off; p < nl; p++) {
 		/* Skip CR */
-		if (buf[off] == '\r')
+		if (*p == '\r')
 			continue;
-		if (buf[off] == '\n') {
-			buf[off] = '\0';
-			break;
-		}
-		off++;
+		if (off >= bufsz - 1)
+			errx(1, "proxy read too long");
+		buf[off++] = *p;
 	}
+	buf[off] = '\0';
+	pr->len -= nl + 1 - (pr->buf + pr->off);
+	pr->off = nl + 1 - pr->buf;
 	return (off);
 }
 
+
+/* The proxy password once it has been read, for all later requests. */
+static const char *proxypass;
+
 static const char *
 getproxypass(const char *proxyuser, const char *proxyhost)
 {
@@ -124,24 +222,43 @@ getproxypass(const char *proxyuser, const char *proxyhost)
 	return (pw);
 }
 
-int
-socks_connect(const char *host, const char *port,
-    struct addrinfo hints __attribute__ ((__unused__)),
-    const char *proxyhost, const char *proxyport, struct addrinfo proxyhints,
-    int socksv, const char *proxyuser)
+/*
+ * Read the password of proxyuser now instead of on the first 407 reply,
+ * so that every request can carry it.
+ */
+void
+socks_password(const char *proxyuser, const char *proxyhost)
+{
+	if (proxypass == NULL)
+		proxypass = getproxypass(proxyuser, proxyhost);
+}
+
+/*
+ * The port of the proxy when -x names none.
+ */
+const char *
+socks_port(int socksv)
+{
+	return ((socksv == -1) ? HTTP_PROXY_PORT : SOCKS_PORT);
+}
+
+/*
+ * Put the request for host and port into buf, which holds PROXY_REQ_SIZE
+ * bytes, behind the SOCKS 5 greeting if greet is set. An HTTP request
+ * carries the credentials of proxyuser once the password is known.
+ * Returns its length.
+ */
+static size_t
+proxy_request(unsigned char *buf, const char *host, const char *port,
+    int socksv, int greet, const char *proxyuser)
 {
-	int proxyfd, r, authretry = 0;
-	size_t hlen, wlen;
-	unsigned char buf[1024];
-	size_t cnt;
 	struct sockaddr_storage addr;
 	struct sockaddr_in *in4 = (struct sockaddr_in *)&addr;
 	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
 	in_port_t serverport;
-	const char *proxypass = NULL;
-
-	if (proxyport == NULL)
-		proxyport = (socksv == -1) ? HTTP_PROXY_PORT : SOCKS_PORT;
+	unsigned char *p = buf;
+	size_t hlen;
+	int r;
 
 	/* Abuse API to lookup port */
 	if (decode_addrport("0.0.0.0", port, (struct sockaddr *)&addr,
@@ -149,35 +266,21 @@ socks_connect(const char *host, const char *port,
 		errx(1, "unknown port \"%.64s\"", port);
 	serverport = in4->sin_port;
 
- again:
-	if (authretry++ > 3)
-		errx(1, "Too many authentication failures");
-
-	proxyfd = remote_connect(proxyhost, proxyport, proxyhints);
-
-	if (proxyfd < 0)
-		return (-1);
-
 	if (socksv == 5) {
 		if (decode_addrport(host, port, (struct sockaddr *)&addr,
 		    sizeof(addr), 0, 1) == -1)
 			addr.ss_family = 0; /* used in switch below */
 
-		/* Version 5, one method: no authentication */
-		buf[0] = SOCKS_V5;
-		buf[1] = 1;
-		buf[2] = SOCKS_NOAUTH;
-		cnt = atomicio(vwrite, proxyfd, buf, 3);
-		if (cnt != 3)
-			err(1, "write failed (%d/3)", (int)cnt);
-
-		cnt = atomicio(read, proxyfd, buf, 2);
-		if (cnt != 2)
-			err(1, "read failed (%d/3)", (int)cnt);
-
-		if (buf[1] == SOCKS_NOMETHOD)
-			errx(1, "authentication method negotiation failed");
+		if (greet) {
+			/* Version 5, one method: no authentication */
+			*p++ = SOCKS_V5;
+			*p++ = 1;
+			*p++ = SOCKS_NOAUTH;
+		}
 
+		p[0] = SOCKS_V5;
+		p[1] = SOCKS_CONNECT;
+		p[2] = 0;
 		switch (addr.ss_family) {
 		case 0:
 			/* Version 5, connect: domain name */
@@ -186,71 +289,58 @@ socks_connect(const char *host, const char *port,
 			hlen = strlen(host);
 			if (hlen > 255)
 				errx(1, "host name too long for SOCKS5");
-			buf[0] = SOCKS_V5;
-			buf[1] = SOCKS_CONNECT;
-			buf[2] = 0;
-			buf[3] = SOCKS_DOMAIN;
-			buf[4] = hlen;
-			memcpy(buf + 5, host, hlen);			
-			memcpy(buf + 5 + hlen, &serverport, sizeof serverport);
-			wlen = 7 + hlen;
+			p[3] = SOCKS_DOMAIN;
+			p[4] = hlen;
+			memcpy(p + 5, host, hlen);
+			memcpy(p + 5 + hlen, &serverport, sizeof serverport);
+			p += 7 + hlen;
 			break;
 		case AF_INET:
 			/* Version 5, connect: IPv4 address */
-			buf[0] = SOCKS_V5;
-			buf[1] = SOCKS_CONNECT;
-			buf[2] = 0;
-			buf[3] = SOCKS_IPV4;
-			memcpy(buf + 4, &in4->sin_addr, sizeof in4->sin_addr);
-			memcpy(buf + 8, &in4->sin_port, sizeof in4->sin_port);
-			wlen = 10;
+			p[3] = SOCKS_IPV4;
+			memcpy(p + 4, &in4->sin_addr, sizeof in4->sin_addr);
+			memcpy(p + 8, &in4->sin_port, sizeof in4->sin_port);
+			p += 10;
 			break;
 		case AF_INET6:
 			/* Version 5, connect: IPv6 address */
-			buf[0] = SOCKS_V5;
-			buf[1] = SOCKS_CONNECT;
-			buf[2] = 0;
-			buf[3] = SOCKS_IPV6;
-			memcpy(buf + 4, &in6->sin6_addr, sizeof in6->sin6_addr);
-			memcpy(buf + 20, &in6->sin6_port,
-			    sizeof in6->sin6_port);
-			wlen = 22;
+			p[3] = SOCKS_IPV6;
+			memcpy(p + 4, &in6->sin6_addr, sizeof in6->sin6_addr);
+			memcpy(p + 20, &in6->sin6_port, sizeof in6->sin6_port);
+			p += 22;
 			break;
 		default:
 			errx(1, "internal error: silly AF");
 		}
-
-		cnt = atomicio(vwrite, proxyfd, buf, wlen);
-		if (cnt != wlen)
-			err(1, "write failed (%d/%d)", (int)cnt, (int)wlen);
-
-		cnt = atomicio(read, proxyfd, buf, 10);
-		if (cnt != 10)
-			err(1, "read failed (%d/10)", (int)cnt);
-		if (buf[1] != 0)
-			errx(1, "connection failed, SOCKS error %d", buf[1]);
 	} else if (socksv == 4) {
-		/* This will exit on lookup failure */
-		decode_addrport(host, port, (struct sockaddr *)&addr,
-		    sizeof(addr), 1, 0);
-
-		/* Version 4 */
-		buf[0] = SOCKS_V4;
-		buf[1] = SOCKS_CONNECT;	/* connect */
-		memcpy(buf + 2, &in4->sin_port, sizeof in4->sin_port);
-		memcpy(buf + 4, &in4->sin_addr, sizeof in4->sin_addr);
-		buf[8] = 0;	/* empty username */
-		wlen = 9;
-
-		cnt = atomicio(vwrite, proxyfd, buf, wlen);
-		if (cnt != wlen)
-			err(1, "write failed (%d/%d)", (int)cnt, (int)wlen);
-
-		cnt = atomicio(read, proxyfd, buf, 8);
-		if (cnt != 8)
-			err(1, "read failed (%d/8)", (int)cnt);
-		if (buf[1] != 90)
-			errx(1, "connection failed, SOCKS error %d", buf[1]);
+		/*
+		 * Version 4 takes IPv4 addresses. The proxy looks up a name
+		 * itself (SOCKS 4A): the address is 0.0.0.1 and the name
+		 * follows the username.
+		 */
+		if (decode_addrport(host, port, (struct sockaddr *)&addr,
+		    sizeof(addr), 1, 1) == -1) {
+			if (strchr(host, ':') != NULL)
+				errx(1, "no IPv6 support in SOCKS4");
+			hlen = strlen(host);
+			if (hlen > 255)
+				errx(1, "host name too long for SOCKS4");
+			in4->sin_port = serverport;
+			in4->sin_addr.s_addr = htonl(1);
+		} else
+			hlen = 0;
+
+		p[0] = SOCKS_V4;
+		p[1] = SOCKS_CONNECT;	/* connect */
+		memcpy(p + 2, &in4->sin_port, sizeof in4->sin_port);
+		memcpy(p + 4, &in4->sin_addr, sizeof in4->sin_addr);
+		p[8] = 0;	/* empty username */
+		p += 9;
+		if (hlen > 0) {
+			memcpy(p, host, hlen);
+			p[hlen] = 0;
+			p += hlen + 1;
+		}
 	} else if (socksv == -1) {
 		/* HTTP proxy CONNECT */
 
@@ -260,52 +350,164 @@ socks_connect(const char *host, const char *port,
 
 		/* Try to be sane about numeric IPv6 addresses */
 		if (strchr(host, ':') != NULL) {
-			r = snprintf((char*)buf, sizeof(buf),
+			r = snprintf((char*)p, PROXY_LINE_SIZE,
 			    "CONNECT [%s]:%d HTTP/1.0\r\n",
 			    host, ntohs(serverport));
 		} else {
-			r = snprintf((char*)buf, sizeof(buf),
+			r = snprintf((char*)p, PROXY_LINE_SIZE,
 			    "CONNECT %s:%d HTTP/1.0\r\n",
 			    host, ntohs(serverport));
 		}
-		if (r == -1 || (size_t)r >= sizeof(buf))
+		if (r == -1 || r >= PROXY_LINE_SIZE)
 			errx(1, "hostname too long");
-		r = strlen((char*)buf);
-
-		cnt = atomicio(vwrite, proxyfd, buf, r);
-		if (cnt != r)
-			err(1, "write failed (%d/%d)", (int)cnt, (int)r);
+		p += r;
 
-		if (authretry > 1) {
-			char resp[1024];
+		if (proxyuser != NULL && proxypass != NULL) {
+			char cred[PROXY_LINE_SIZE], resp[PROXY_LINE_SIZE];
 
-			proxypass = getproxypass(proxyuser, proxyhost);
-			r = snprintf((char*)buf, sizeof(buf), "%s:%s",
+			r = snprintf(cred, sizeof(cred), "%s:%s",
 			    proxyuser, proxypass);
-			if (r == -1 || (size_t)r >= sizeof(buf) ||
-			    b64_ntop(buf, strlen((char*)buf), resp,
+			if (r == -1 || (size_t)r >= sizeof(cred) ||
+			    b64_ntop((unsigned char *)cred, strlen(cred), resp,
 			    sizeof(resp)) == -1)
 				errx(1, "Proxy username/password too long");
-			r = snprintf((char*)buf, sizeof((char*)buf), "Proxy-Authorization: "
-			    "Basic %s\r\n", resp);
-			if (r == -1 || (size_t)r >= sizeof(buf))
+			r = snprintf((char*)p, PROXY_LINE_SIZE,
+			    "Proxy-Authorization: Basic %s\r\n", resp);
+			if (r == -1 || r >= PROXY_LINE_SIZE)
 				errx(1, "Proxy auth response too long");
-			r = strlen((char*)buf);
-			if ((cnt = atomicio(vwrite, proxyfd, buf, r)) != r)
-				err(1, "write failed (%d/%d)", (int)cnt, r);
+			p += r;
 		}
 
 		/* Terminate headers */
-		if ((r = atomicio(vwrite, proxyfd, "\r\n", 2)) != 2)
-			err(1, "write failed (2/%d)", r);
+		memcpy(p, "\r\n", 2);
+		p += 2;
+	} else
+		errx(1, "Unknown proxy protocol %d", socksv);
+
+	return (p - buf);
+}
+
+/*
+ * The length of a SOCKS 5 reply from its first 5 bytes, which depends on
+ * the type of the bound address that it carries.
+ */
+static size_t
+socks5_reply_len(const unsigned char *p)
+{
+	switch (p[3]) {
+	case SOCKS_IPV4:
+		return (4 + 4 + 2);
+	case SOCKS_DOMAIN:
+		return (4 + 1 + p[4] + 2);
+	case SOCKS_IPV6:
+		return (4 + 16 + 2);
+	default:
+		return (0);
+	}
+}
+
+int
+socks_connect(const char *host, const char *port,
+    struct addrinfo hints __attribute__ ((__unused__)),
+    const char *proxyhost, const char *proxyport, struct addrinfo proxyhints,
+    int socksv, const char *proxyuser, int optimistic, const void *early,
+    size_t earlylen)
+{
+	int proxyfd, r, authretry = 0, authsent, iovcnt;
+	unsigned char buf[1024], req[PROXY_REQ_SIZE];
+	struct iovec iov[2];
+	size_t cnt, rlen;
+	struct proxy_reader pr;
+
+	if (proxyport == NULL)
+		proxyport = socks_port(socksv);
+
+ again:
+	if (authretry++ > 3)
+		errx(1, "Too many authentication failures");
+	if (socksv == -1 && authretry > 1 && proxypass == NULL)
+		proxypass = getproxypass(proxyuser, proxyhost);
+
+	proxyfd = remote_connect(proxyhost, proxyport, proxyhints);
+
+	if (proxyfd < 0)
+		return (-1);
+	pr.fd = proxyfd;
+	pr.off = pr.len = 0;
+
+	/*
+	 * The SOCKS 5 greeting goes first on its own, unless the client is
+	 * optimistic: then it is sent right in front of the request and the
+	 * method reply is checked afterwards, saving a round trip.
+	 */
+	if (socksv == 5 && !optimistic) {
+		/* Version 5, one method: no authentication */
+		buf[0] = SOCKS_V5;
+		buf[1] = 1;
+		buf[2] = SOCKS_NOAUTH;
+		cnt = atomicio(vwrite, proxyfd, buf, 3);
+		if (cnt != 3)
+			err(1, "write failed (%d/3)", (int)cnt);
 
+		cnt = proxy_read(&pr, buf, 2);
+		if (cnt != 2)
+			err(1, "read failed (%d/3)", (int)cnt);
+
+		if (buf[1] == SOCKS_NOMETHOD)
+			errx(1, "authentication method negotiation failed");
+	}
+
+	/*
+	 * The request goes out in one piece. An optimistic client sends its
+	 * first data behind it, again on a 407 retry.
+	 */
+	iov[0].iov_base = req;
+	iov[0].iov_len = proxy_request(req, host, port, socksv, optimistic,
+	    proxyuser);
+	iovcnt = 1;
+	if (optimistic && earlylen > 0) {
+		iov[1].iov_base = (void *)early;
+		iov[1].iov_len = earlylen;
+		iovcnt = 2;
+	}
+	authsent = socksv == -1 && proxyuser != NULL && proxypass != NULL;
+	proxy_write(proxyfd, iov, iovcnt);
+
+	if (socksv == 5) {
+		if (optimistic) {
+			cnt = proxy_read(&pr, buf, 2);
+			if (cnt != 2)
+				err(1, "read failed (%d/2)", (int)cnt);
+			if (buf[1] == SOCKS_NOMETHOD)
+				errx(1, "authentication method negotiation "
+				    "failed");
+		}
+
+		cnt = proxy_read(&pr, buf, 5);
+		if (cnt != 5)
+			err(1, "read failed (%d/5)", (int)cnt);
+		if (buf[1] != 0)
+			errx(1, "connection failed, SOCKS error %d", buf[1]);
+		if ((rlen = socks5_reply_len(buf)) == 0)
+			errx(1, "unknown SOCKS address type %d", buf[3]);
+		cnt = proxy_read(&pr, buf + 5, rlen - 5);
+		if (cnt != rlen - 5)
+			err(1, "read failed (%d/%d)", (int)cnt + 5, (int)rlen);
+	} else if (socksv == 4) {
+		cnt = proxy_read(&pr, buf, 8);
+		if (cnt != 8)
+			err(1, "read failed (%d/8)", (int)cnt);
+		if (buf[1] != 90)
+			errx(1, "connection failed, SOCKS error %d", buf[1]);
+	} else {
 		/* Read status reply */
-		proxy_read_line(proxyfd, (char*)buf, sizeof(buf));
+		proxy_read_line(&pr, (char*)buf, sizeof(buf));
 		if (proxyuser != NULL &&
 		    strncmp((char*)buf, "HTTP/1.0 407 ", 12) == 0) {
-			if (authretry > 1) {
+			if (authsent) {
 				fprintf(stderr, "Proxy authentication "
 				    "failed\n");
+				proxypass = NULL;
 			}
 			close(proxyfd);
 			goto again;
@@ -315,14 +517,163 @@ socks_connect(const char *host, const char *port,
 
 		/* Headers continue until we hit an empty line */
 		for (r = 0; r < HTTP_MAXHDRS; r++) {
-			proxy_read_line(proxyfd, (char*)buf, sizeof(buf));
+			proxy_read_line(&pr, (char*)buf, sizeof(buf));
 			if (*buf == '\0')
 				break;
 		}
 		if (*buf != '\0')
 			errx(1, "Too many proxy headers received");
-	} else
-		errx(1, "Unknown proxy protocol %d", socksv);
+	}
 
+	/* Data the target sent right behind the reply goes out first. */
+	relay_preload(proxyfd, pr.buf + pr.off, pr.len);
 	return (proxyfd);
 }
+
+/*
+ * A proxy handshake on a non-blocking socket, for a caller that polls
+ * many of them at once: socks_start() queues the whole request, with
+ * the SOCKS 5 greeting in front, and socks_step() moves it along each
+ * time the socket is ready.
+ */
+struct socks_hs {
+	int		socksv;
+	size_t		woff;	/* Request bytes written */
+	size_t		wlen;	/* Request bytes in all */
+	unsigned char	req[PROXY_REQ_SIZE];
+	struct proxy_reader pr;
+};
+
+struct socks_hs *
+socks_start(int fd, const char *host, const char *port, int socksv,
+    const char *proxyuser)
+{
+	struct socks_hs *hs;
+
+	if ((hs = calloc(1, sizeof(*hs))) == NULL)
+		err(1, NULL);
+	hs->socksv = socksv;
+	hs->wlen = proxy_request(hs->req, host, port, socksv, 1, proxyuser);
+	hs->pr.fd = fd;
+	return (hs);
+}
+
+void
+socks_free(struct socks_hs *hs)
+{
+	free(hs);
+}
+
+/*
+ * Check the reply of the proxy read so far. Returns 1 while it is not
+ * complete, 0 if the proxy connected and -1 with *why if it did not.
+ */
+static int
+socks_parse(struct socks_hs *hs, const char **why)
+{
+	static char msg[128];
+	unsigned char *p = hs->pr.buf, *end = p + hs->pr.len, *nl;
+	size_t len;
+	int lines;
+
+	if (hs->socksv == 5) {
+		if (end - p >= 2 && p[1] == SOCKS_NOMETHOD) {
+			*why = "authentication method negotiation failed";
+			return (-1);
+		}
+		if (end - p < 2 + 5)
+			return (1);
+		p += 2;
+		if (p[1] == 0 && (len = socks5_reply_len(p)) == 0) {
+			snprintf(msg, sizeof(msg),
+			    "unknown SOCKS address type %d", p[3]);
+			*why = msg;
+			return (-1);
+		}
+		if (p[1] == 0 && (size_t)(end - p) < len)
+			return (1);
+	} else if (hs->socksv == 4) {
+		if (end - p < 8)
+			return (1);
+	} else {
+		/* The status line, then headers up to an empty line */
+		for (lines = 0; (nl = memchr(p, '\n', end - p)) != NULL;
+		    lines++) {
+			if (lines == 0 &&
+			    strncmp((char *)p, "HTTP/1.0 200 ", 12) != 0 &&
+			    strncmp((char *)p, "HTTP/1.1 200 ", 12) != 0) {
+				if (nl > p && nl[-1] == '\r')
+					nl--;
+				snprintf(msg, sizeof(msg),
+				    "Proxy error: \"%.*s\"", (int)(nl - p), p);
+				*why = msg;
+				return (-1);
+			}
+			if (lines > 0 && (nl == p || (nl == p + 1 &&
+			    *p == '\r')))
+				return (0);
+			if (lines > HTTP_MAXHDRS) {
+				*why = "Too many proxy headers received";
+				return (-1);
+			}
+			p = nl + 1;
+		}
+		return (1);
+	}
+	if (p[1] != (hs->socksv == 5 ? 0 : 90)) {
+		snprintf(msg, sizeof(msg), "SOCKS error %d", p[1]);
+		*why = msg;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Write what is left of the request and read what the proxy replies,
+ * without blocking. Returns 1 with the poll(2) *events to wait for, 0
+ * once the proxy has connected to the target, or -1 with *why.
+ */
+int
+socks_step(struct socks_hs *hs, short *events, const char **why)
+{
+	ssize_t n;
+	int r;
+
+	while (hs->woff < hs->wlen) {
+		n = send(hs->pr.fd, hs->req + hs->woff, hs->wlen - hs->woff,
+		    MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN) {
+			*events = POLLOUT;
+			return (1);
+		}
+		if (n == -1) {
+			*why = strerror(errno);
+			return (-1);
+		}
+		hs->woff += n;
+	}
+
+	while ((r = socks_parse(hs, why)) == 1) {
+		if (hs->pr.len == sizeof(hs->pr.buf)) {
+			*why = "proxy read too long";
+			return (-1);
+		}
+		n = read(hs->pr.fd, hs->pr.buf + hs->pr.len,
+		    sizeof(hs->pr.buf) - hs->pr.len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN) {
+			*events = POLLIN;
+			return (1);
+		}
+		if (n <= 0) {
+			*why = n == 0 ? "proxy closed the connection" :
+			    strerror(errno);
+			return (-1);
+		}
+		hs->pr.len += n;
+	}
+	return (r);
+}